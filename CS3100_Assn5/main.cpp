@@ -23,14 +23,43 @@
 */
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <cstdio>
 #include <cstdlib>
 #include <cmath>
 #include <string>
 #include <queue>
+#include <list>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <unordered_map>
+#include <vector>
+#include <cstring>
+#include <climits>
+
+#ifdef __linux__
+#include <csignal>
+#include <sys/time.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 /* uncomment the following line to use 'long long' integers */
 /* #define HAS_LONG_LONG */
@@ -85,6 +114,77 @@ int pow_mod(int a, int b, int m)
 	return r;
 }
 
+/* return (a * b) mod m for moduli up to 2^62 */
+long long mul_mod_wide(long long a, long long b, long long m)
+{
+#ifdef __SIZEOF_INT128__
+	return (long long)((unsigned __int128)a * b % m);
+#else
+	//Shift and add; every partial stays below 2m < 2^63
+	long long r = 0;
+	for (a %= m; b != 0; b >>= 1) {
+		if (b & 1) {
+			r += a;
+			if (r >= m)
+				r -= m;
+		}
+		a += a;
+		if (a >= m)
+			a -= m;
+	}
+	return r;
+#endif
+}
+
+/* return (a * b) mod m, through the 64 bit product when m fits an int */
+long long mul_mod_any(long long a, long long b, long long m)
+{
+	return m <= INT_MAX ? mul_mod(a, b, m) : mul_mod_wide(a, b, m);
+}
+
+/* return the inverse of x mod y for 64 bit moduli */
+long long inv_mod_wide(long long x, long long y)
+{
+	long long q, u, v, a, c, t;
+
+	u = x;
+	v = y;
+	c = 1;
+	a = 0;
+	do {
+		q = v / u;
+
+		t = c;
+		c = a - q * c;
+		a = t;
+
+		t = u;
+		u = v - q * u;
+		v = t;
+	} while (u != 0);
+	a = a % y;
+	if (a < 0)
+		a = y + a;
+	return a;
+}
+
+/* return 10^e mod m for any modulus up to 2^62 */
+long long pow10_mod(int e, long long m)
+{
+	if (m <= INT_MAX)
+		return pow_mod(10, e, (int)m);
+	long long r = 1, aa = 10;
+	while (1) {
+		if (e & 1)
+			r = mul_mod_wide(r, aa, m);
+		e = e >> 1;
+		if (e == 0)
+			break;
+		aa = mul_mod_wide(aa, aa, m);
+	}
+	return r;
+}
+
 /* return true if n is prime */
 int is_prime(int n)
 {
@@ -108,72 +208,1067 @@ int next_prime(int n)
 	return n;
 }
 
-unsigned int computePiDigit(int n)
+#ifdef __linux__
+//Built-in sampling profiler.  ITIMER_PROF raises SIGPROF as the process
+//uses CPU and the handler copies a short stack into a ring owned by the
+//interrupted thread.  Each ring has one writer, its own thread, so
+//recording takes no locks.
+class SamplingProfiler {
+public:
+	static const int DEPTH = 8;
+	static const int SKIP = 2;
+	static const int SAMPLES = 1 << 13;
+
+	struct Sample {
+		const char *engine;
+		int depth;
+		void *pc[DEPTH];
+	};
+	struct Buffer {
+		std::atomic<unsigned int> count;
+		const char *engine;
+		Sample samples[SAMPLES];
+	};
+
+	static SamplingProfiler &instance() {
+		static SamplingProfiler profiler;
+		return profiler;
+	}
+	void start(int hz) {
+		//backtrace loads the unwinder on first use, which must not happen in the handler
+		void *warm[DEPTH];
+		backtrace(warm, DEPTH);
+		running = true;
+		enterThread("main");
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = onSignal;
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGPROF, &sa, nullptr);
+		struct itimerval timer;
+		timer.it_interval.tv_sec = 0;
+		timer.it_interval.tv_usec = 1000000 / hz;
+		timer.it_value = timer.it_interval;
+		setitimer(ITIMER_PROF, &timer, nullptr);
+	}
+	void stop() {
+		struct itimerval timer;
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_PROF, &timer, nullptr);
+		signal(SIGPROF, SIG_IGN);
+		running = false;
+	}
+	/* give the calling thread a ring and name the engine it runs */
+	void enterThread(const char *engine) {
+		if (!running && current == nullptr)
+			return;
+		if (current == nullptr) {
+			//The handler may run the moment current is set, so the ring
+			//must already be complete and named
+			std::unique_ptr<Buffer> buffer(new Buffer());
+			buffer->count = 0;
+			buffer->engine = engine;
+			Buffer *ring = buffer.get();
+			buffersMutex.lock();
+			buffers.push_back(std::move(buffer));
+			buffersMutex.unlock();
+			std::atomic_signal_fence(std::memory_order_release);
+			current = ring;
+			return;
+		}
+		current->engine = engine;
+	}
+	/* print the hottest functions and the share of samples per engine */
+	void report(std::ostream &out) {
+		std::unordered_map<std::string, unsigned int> functions, engines;
+		unsigned int total = 0;
+		buffersMutex.lock();
+		for (auto &buffer : buffers) {
+			unsigned int n = std::min<unsigned int>(buffer->count, SAMPLES);
+			for (unsigned int i = 0; i < n; i++) {
+				const Sample &sample = buffer->samples[i];
+				functions[symbolize(sample.depth > SKIP ? sample.pc[SKIP] : nullptr)]++;
+				engines[sample.engine != nullptr ? sample.engine : "unknown"]++;
+				total++;
+			}
+		}
+		buffersMutex.unlock();
+
+		out << "Profile: " << total << " samples\n";
+		if (total == 0)
+			return;
+		std::vector<std::pair<unsigned int, std::string>> top;
+		for (auto &f : functions)
+			top.push_back({ f.second, f.first });
+		std::sort(top.rbegin(), top.rend());
+		for (size_t i = 0; i < top.size() && i < 15; i++)
+			out << "  " << 100.0 * top[i].first / total << "%\t" << top[i].second << "\n";
+		out << "By engine:\n";
+		for (auto &e : engines)
+			out << "  " << 100.0 * e.second / total << "%\t" << e.first << "\n";
+	}
+private:
+	static void onSignal(int) {
+		Buffer *buffer = current;
+		if (buffer == nullptr)
+			return;
+		unsigned int i = buffer->count.load(std::memory_order_relaxed);
+		Sample &sample = buffer->samples[i % SAMPLES];
+		sample.engine = buffer->engine;
+		sample.depth = backtrace(sample.pc, DEPTH);
+		buffer->count.store(i + 1, std::memory_order_release);
+	}
+	static std::string symbolize(void *pc) {
+		Dl_info info;
+		if (pc == nullptr || !dladdr(pc, &info) || info.dli_sname == nullptr) {
+			std::ostringstream name;
+			name << pc;
+			return name.str();
+		}
+		int status;
+		char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		std::string name = status == 0 ? demangled : info.dli_sname;
+		free(demangled);
+		return name;
+	}
+
+	std::mutex buffersMutex;
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	bool running = false;
+	static thread_local Buffer *current;
+};
+
+thread_local SamplingProfiler::Buffer *SamplingProfiler::current = nullptr;
+#endif
+
+/* tag the calling worker thread for the profiler, a no-op unless it is running */
+inline void profileThread(const char *engine)
+{
+#ifdef __linux__
+	SamplingProfiler::instance().enterThread(engine);
+#endif
+}
+
+//Runs the profiler for its lifetime and prints the report at the end
+class ProfilerSession {
+public:
+	static const int DEFAULT_HZ = 100;
+
+	ProfilerSession(bool enabled) : enabled(enabled) {
+#ifdef __linux__
+		if (enabled)
+			SamplingProfiler::instance().start(DEFAULT_HZ);
+#else
+		if (enabled)
+			std::cerr << "--profile is only supported on Linux\n";
+#endif
+	}
+	~ProfilerSession() {
+#ifdef __linux__
+		if (enabled) {
+			SamplingProfiler::instance().stop();
+			SamplingProfiler::instance().report(std::cerr);
+		}
+#endif
+	}
+private:
+	bool enabled;
+};
+
+//Logical CPUs this process may run on, with the physical core and L3
+//domain each belongs to, read from sysfs and the affinity mask.  Elsewhere
+//every logical CPU counts as its own core and nothing is pinned.
+struct CpuTopology {
+	struct Cpu {
+		int id;
+		int core;
+		int l3;
+	};
+	std::vector<Cpu> cpus;
+
+	static CpuTopology read() {
+		CpuTopology topology;
+#ifdef __linux__
+		//Leave out CPUs outside our mask (taskset, cpusets) so no worker is
+		//placed where it cannot be pinned
+		cpu_set_t allowed;
+		bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+		for (int id : parseCpuList(readLine("/sys/devices/system/cpu/online"))) {
+			if (masked && (id >= CPU_SETSIZE || !CPU_ISSET(id, &allowed)))
+				continue;
+			std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(id);
+			std::vector<int> siblings = parseCpuList(readLine(dir + "/topology/thread_siblings_list"));
+			std::vector<int> l3 = parseCpuList(readLine(dir + "/cache/index3/shared_cpu_list"));
+			//The lowest CPU of a sibling or cache list names the core or domain
+			topology.cpus.push_back(Cpu{ id, siblings.empty() ? id : siblings[0],
+				l3.empty() ? std::atoi(readLine(dir + "/topology/physical_package_id").c_str()) : l3[0] });
+		}
+#endif
+		if (topology.cpus.empty()) {
+			int n = std::max(1u, std::thread::hardware_concurrency());
+			for (int i = 0; i < n; i++)
+				topology.cpus.push_back(Cpu{ -1, i, 0 });
+		}
+		return topology;
+	}
+	int physicalCores() const {
+		std::vector<int> cores;
+		for (const Cpu &c : cpus)
+			if (std::find(cores.begin(), cores.end(), c.core) == cores.end())
+				cores.push_back(c.core);
+		return (int)cores.size();
+	}
+	/* return CPU ids in placement order: one per physical core, alternating
+	   L3 domains, then the SMT siblings if useSmt.  -1 means unpinned. */
+	std::vector<int> placement(bool useSmt) const {
+		std::vector<Cpu> first, rest;
+		std::vector<int> seen;
+		for (const Cpu &c : cpus) {
+			if (std::find(seen.begin(), seen.end(), c.core) == seen.end()) {
+				seen.push_back(c.core);
+				first.push_back(c);
+			}
+			else
+				rest.push_back(c);
+		}
+		//Round-robin over L3 domains so the first workers spread out
+		std::vector<int> order;
+		std::vector<bool> used(first.size(), false);
+		while (order.size() < first.size()) {
+			std::vector<int> domains;
+			for (size_t i = 0; i < first.size(); i++) {
+				if (used[i] || std::find(domains.begin(), domains.end(), first[i].l3) != domains.end())
+					continue;
+				domains.push_back(first[i].l3);
+				used[i] = true;
+				order.push_back(first[i].id);
+			}
+		}
+		if (useSmt)
+			for (const Cpu &c : rest)
+				order.push_back(c.id);
+		return order;
+	}
+private:
+	static std::string readLine(const std::string &path) {
+		std::ifstream in(path);
+		std::string line;
+		std::getline(in, line);
+		return line;
+	}
+	/* parse a sysfs CPU list such as "0-3,8-11" */
+	static std::vector<int> parseCpuList(const std::string &list) {
+		std::vector<int> ids;
+		std::stringstream items(list);
+		std::string item;
+		while (std::getline(items, item, ',')) {
+			size_t dash = item.find('-');
+			int lo = std::atoi(item.c_str());
+			int hi = dash == std::string::npos ? lo : std::atoi(item.c_str() + dash + 1);
+			for (int i = lo; i <= hi && !item.empty(); i++)
+				ids.push_back(i);
+		}
+		return ids;
+	}
+};
+
+/* pin the calling thread to a logical CPU, a no-op for -1 or off Linux */
+void pinThread(int cpu)
 {
-	int av, a, vmax, N, num, den, k, kq, kq2, t, v, s, i;
-	double sum = 0;
+#ifdef __linux__
+	if (cpu < 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+//Process-wide memory budget.  Engines reserve their expected footprint
+//before allocating: available() lets them pick a leaner plan up front and
+//reserve() queues until enough has been released.  On Linux the memory
+//PSI "some avg10" figure shrinks the budget so new work backs off early.
+class MemoryGovernor {
+public:
+	static const int PSI_BACKOFF = 10;
+	static const int STALL_SECONDS = 10;
+
+	static MemoryGovernor &instance() {
+		static MemoryGovernor governor;
+		return governor;
+	}
+	void setBudget(size_t bytes) {
+		std::lock_guard<std::mutex> guard(governorMutex);
+		budget = bytes;
+		released.notify_all();
+	}
+	/* return the bytes that can be reserved right now */
+	size_t available() {
+		std::lock_guard<std::mutex> guard(governorMutex);
+		size_t limit = effectiveBudget();
+		return limit > used ? limit - used : 0;
+	}
+	size_t inUse() const {
+		return used.load();
+	}
+	/* wait until bytes fit the budget and take them.  A request larger than
+	   the whole budget is let through alone.  Waiting only helps while other
+	   work gives memory back: once nothing has been released for
+	   STALL_SECONDS the holders are taken to be waiting on the caller, and
+	   the bytes are granted over budget rather than never. */
+	void reserve(size_t bytes) {
+		std::unique_lock<std::mutex> guard(governorMutex);
+		size_t seen = releases;
+		auto stalled = std::chrono::steady_clock::now();
+		while (used != 0 && used + bytes > effectiveBudget()) {
+			released.wait_for(guard, std::chrono::seconds(1));
+			auto now = std::chrono::steady_clock::now();
+			if (releases != seen) {
+				seen = releases;
+				stalled = now;
+			}
+			else if (now - stalled >= std::chrono::seconds(STALL_SECONDS)) {
+				std::cerr << "Memory budget exceeded by " << ((used + bytes - effectiveBudget()) >> 20)
+					<< " MB, nothing left to wait for\n";
+				break;
+			}
+		}
+		used += bytes;
+	}
+	void release(size_t bytes) {
+		std::lock_guard<std::mutex> guard(governorMutex);
+		used -= std::min(used.load(), bytes);
+		releases++;
+		released.notify_all();
+	}
+private:
+	MemoryGovernor() : budget(defaultBudget()), used(0), releases(0), pressure(0) {}
+
+	/* half of physical memory, or 1 GB where that is unknown */
+	static size_t defaultBudget() {
+#ifdef __linux__
+		std::ifstream in("/proc/meminfo");
+		std::string key;
+		size_t kb;
+		while (in >> key >> kb)
+			if (key == "MemTotal:")
+				return kb * 1024 / 2;
+#endif
+		return (size_t)1 << 30;
+	}
+	/* budget scaled down by recent memory pressure, PSI read at most once a second */
+	size_t effectiveBudget() {
+#ifdef __linux__
+		auto now = std::chrono::steady_clock::now();
+		if (now - pressureRead >= std::chrono::seconds(1)) {
+			pressureRead = now;
+			std::ifstream in("/proc/pressure/memory");
+			std::string some, avg10;
+			pressure = 0;
+			if (in >> some >> avg10 && some == "some" && avg10.compare(0, 6, "avg10=") == 0)
+				pressure = std::atof(avg10.c_str() + 6);
+		}
+#endif
+		if (pressure >= 4 * PSI_BACKOFF)
+			return budget / 4;
+		if (pressure >= PSI_BACKOFF)
+			return budget / 2;
+		return budget;
+	}
+
+	std::mutex governorMutex;
+	std::condition_variable released;
+	size_t budget;
+	std::atomic<size_t> used;
+	size_t releases;
+	double pressure;
+	std::chrono::steady_clock::time_point pressureRead;
+};
+
+//chrono takes its count by reference, which needs a definition before C++17
+const int MemoryGovernor::STALL_SECONDS;
+
+//Bytes held from the governor, given back when this goes away
+class MemoryReservation {
+public:
+	MemoryReservation() : bytes(0) {}
+	~MemoryReservation() {
+		MemoryGovernor::instance().release(bytes);
+	}
+	void reserve(size_t n) {
+		MemoryGovernor::instance().reserve(n);
+		bytes += n;
+	}
+private:
+	MemoryReservation(const MemoryReservation &);
+	MemoryReservation &operator=(const MemoryReservation &);
+	size_t bytes;
+};
+
+//Modular multiply backends for the k loop.  Int is the type residues are
+//kept in, inv() the modular inverse.
+struct PlainMulMod {
+	typedef int Int;
+	int m;
+	PlainMulMod(int m) : m(m) {}
+	int operator()(int a, int b) const {
+		return (int)mul_mod(a, b, m);
+	}
+	int inv(int x) const {
+		return inv_mod(x, m);
+	}
+};
+
+//Quotient estimated with a floating point reciprocal, off by at most one
+struct ReciprocalMulMod {
+	typedef int Int;
+	long long m;
+	double inv_m;
+	ReciprocalMulMod(int m) : m(m), inv_m(1.0 / m) {}
+	int inv(int x) const {
+		return inv_mod(x, (int)m);
+	}
+	int operator()(int a, int b) const {
+		long long q = (long long)((double)a * (double)b * inv_m);
+		long long r = (long long)a * b - q * m;
+		if (r < 0)
+			r += m;
+		else if (r >= m)
+			r -= m;
+		return (int)r;
+	}
+};
+
+//Moduli past INT_MAX, taken by the few small primes whose a^vmax is that
+//large in the series with a D(k) factor
+struct WideMulMod {
+	typedef long long Int;
+	long long m;
+	WideMulMod(long long m) : m(m) {}
+	long long operator()(long long a, long long b) const {
+		return mul_mod_wide(a, b, m);
+	}
+	long long inv(long long x) const {
+		return inv_mod_wide(x, m);
+	}
+};
+
+//Machine specific choices written by --tune and read back on every run
+struct TuningProfile {
+	enum MulModBackend { PLAIN, RECIPROCAL };
+
+	MulModBackend mulMod = PLAIN;
+	bool smtDecimal = true;
+	bool smtHex = true;
+
+	/* read key=value lines, return false if the file cannot be opened */
+	bool load(const std::string &path) {
+		std::ifstream in(path);
+		if (!in)
+			return false;
+		std::string line;
+		while (std::getline(in, line)) {
+			size_t eq = line.find('=');
+			if (line.empty() || line[0] == '#' || eq == std::string::npos)
+				continue;
+			std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+			if (key == "mulmod")
+				mulMod = value == "reciprocal" ? RECIPROCAL : PLAIN;
+			else if (key == "smt.decimal")
+				smtDecimal = value == "1";
+			else if (key == "smt.hex")
+				smtHex = value == "1";
+		}
+		return true;
+	}
+	bool save(const std::string &path, const std::string &notes) const {
+		std::ofstream out(path);
+		out << notes;
+		out << "mulmod=" << (mulMod == RECIPROCAL ? "reciprocal" : "plain") << "\n";
+		out << "smt.decimal=" << smtDecimal << "\n";
+		out << "smt.hex=" << smtHex << "\n";
+		return (bool)out;
+	}
+};
 
-	N = (int)((n + 20) * std::log(10) / std::log(2));
+const char *TUNING_FILE = "pi_tune.txt";
+TuningProfile tuning;
+
+//A hypergeometric series  sum_{k>=1} M(k) / D(k)^dpow * prod_{i=1..k} P(i)/Q(i)
+//with P, Q, M, D linear in k and positive for k >= 1.  Digit extraction
+//needs every prime's valuation in the reduced denominators to stay within
+//log_a Q(N) + dpow log_a D(N), which holds for central binomial series like
+//the ones below.  Series whose denominators gain a factor every term, such
+//as e (k!) or log 2 (2^k), do not fit.
+struct HypergeometricSeries {
+	const char *name;
+	const char *integerPart;
+	int p1, p0, q1, q0, m1, m0, d1, d0, dpow;
+	int firstPrime;
+
+	/* return the number of terms for digits up to position last, INT_MAX
+	   when that is past an int, which fits() turns down */
+	int terms(long long last) const {
+		double N = (last + 20) * std::log(10) / std::log(2) / (std::log((double)q1 / p1) / std::log(2));
+		return N < INT_MAX ? (int)N : INT_MAX;
+	}
+	/* return the largest prime that can divide a denominator of the first N terms */
+	int primeLimit(int N) const {
+		return std::max(q1 * N + q0, dpow > 0 ? d1 * N + d0 : 0);
+	}
+	/* return true when Q(N) and D(N) fit an int and a^vmax, at most
+	   Q(N) D(N)^dpow, stays within WIDE_LIMIT for every prime */
+	bool fits(int N) const {
+		if (N < 1 || N == INT_MAX)
+			return false;
+		double q = (double)q1 * N + q0, d = (double)d1 * N + d0;
+		return q <= INT_MAX && d <= INT_MAX && q * std::pow(d, dpow) <= WIDE_LIMIT;
+	}
 
-	for (a = 3; a <= (2 * N); a = next_prime(a)) {
+	static constexpr double WIDE_LIMIT = 4611686018427387904.0;	// 2^62
+};
 
-		vmax = (int)(std::log(2 * N) / std::log(a));
-		av = 1;
-		for (i = 0; i < vmax; i++)
-			av = av * a;
+const HypergeometricSeries SERIES[] = {
+	//pi + 3 = sum k 2^k / C(2k,k)
+	{ "pi", "3", 1, 0, 2, -1, 1, 0, 1, 0, 0, 3 },
+	//pi sqrt(3) / 9 = sum 1 / (k C(2k,k))
+	{ "pisqrt3", "0", 1, 0, 4, -2, 0, 1, 1, 0, 1, 2 },
+	//pi^2 / 18 = sum 1 / (k^2 C(2k,k))
+	{ "pi2", "0", 1, 0, 4, -2, 0, 1, 1, 0, 2, 2 },
+};
+const int NUM_SERIES = sizeof(SERIES) / sizeof(SERIES[0]);
 
-		s = 0;
-		num = 1;
-		den = 1;
-		v = 0;
-		kq = 1;
-		kq2 = 1;
+/* return the index of the series called name, -1 if there is none */
+int findSeries(const std::string &name)
+{
+	for (int i = 0; i < NUM_SERIES; i++)
+		if (name == SERIES[i].name)
+			return i;
+	return -1;
+}
 
-		for (k = 1; k <= N; k++) {
+//Loop state of the series sum for one prime.  The k loop can stop after
+//any term and pick up again later, on this or another thread.  rp, rq
+//and rd are P(k), Q(k) and D(k) mod a, so factors of a are found without
+//a division.
+struct PiResidueState {
+	int series;
+	int a, vmax, N;
+	long long av;
+	int k, v, rp, rq, rd;
+	long long num, den, s;
+};
 
-			t = k;
-			if (kq >= a) {
+/* return the largest e with a^e <= x */
+int ilog(int a, long long x)
+{
+	int e = 0;
+	for (long long p = a; p <= x; p *= a)
+		e++;
+	return e;
+}
+
+/* set up the k loop of the series for the prime a */
+void startPiResidue(PiResidueState &r, int series, int a, int N)
+{
+	const HypergeometricSeries &c = SERIES[series];
+	int i;
+
+	r.series = series;
+	r.a = a;
+	r.N = N;
+	r.vmax = ilog(a, (long long)c.q1 * N + c.q0) + c.dpow * ilog(a, (long long)c.d1 * N + c.d0);
+	r.av = 1;
+	for (i = 0; i < r.vmax; i++)
+		r.av = r.av * a;
+
+	r.s = 0;
+	r.num = 1;
+	r.den = 1;
+	r.v = 0;
+	r.rp = (c.p1 + c.p0) % a;
+	r.rq = (c.q1 + c.q0) % a;
+	r.rd = (c.d1 + c.d0) % a;
+	r.k = 1;
+}
+
+/* run the k loop up to and including kEnd, return true once k has passed N.
+   The power of D is a template argument so series without D skip it entirely. */
+template <class MulMod, int dpow>
+bool stepPiResidueDpow(PiResidueState &r, int kEnd)
+{
+	typedef typename MulMod::Int Int;
+	const HypergeometricSeries &c = SERIES[r.series];
+	const int p1 = c.p1, p0 = c.p0, q1 = c.q1, q0 = c.q0, m1 = c.m1, m0 = c.m0, d1 = c.d1, d0 = c.d0;
+	int a = r.a, vmax = r.vmax;
+	Int av = (Int)r.av;
+	MulMod mul(av);
+	Int num = (Int)r.num, den = (Int)r.den, s = (Int)r.s;
+	int v = r.v, rp = r.rp, rq = r.rq, rd = r.rd;
+	int stepP = p1 % a, stepQ = q1 % a, stepD = d1 % a;
+	int k, t, i, vk;
+	Int d, u;
+
+	if (kEnd > r.N)
+		kEnd = r.N;
+
+	for (k = r.k; k <= kEnd; k++) {
+
+		t = p1 * k + p0;
+		if (rp == 0) {
+			do {
+				t = t / a;
+				v--;
+			} while ((t % a) == 0);
+		}
+		num = mul(num, t);
+
+		t = q1 * k + q0;
+		if (rq == 0) {
+			do {
+				t = t / a;
+				v++;
+			} while ((t % a) == 0);
+		}
+		den = mul(den, t);
+
+		vk = v;
+		d = den;
+		if (dpow > 0) {
+			t = d1 * k + d0;
+			if (rd == 0) {
 				do {
 					t = t / a;
-					v--;
+					vk += dpow;
 				} while ((t % a) == 0);
-				kq = 0;
 			}
-			kq++;
-			num = mul_mod(num, t, av);
-
-			t = (2 * k - 1);
-			if (kq2 >= a) {
-				if (kq2 == a) {
-					do {
-						t = t / a;
-						v++;
-					} while ((t % a) == 0);
-				}
-				kq2 -= a;
+			for (i = 0; i < dpow; i++)
+				d = mul(d, t);
+		}
+
+		if (vk > 0) {
+			u = mul.inv(d);
+			u = mul(u, num);
+			u = mul(u, m1 * k + m0);
+			for (i = vk; i < vmax; i++)
+				u = mul(u, a);
+			//s + u can pass INT_MAX once av is past half of it
+			s += u - av;
+			if (s < 0)
+				s += av;
+		}
+
+		rp += stepP;
+		if (rp >= a)
+			rp -= a;
+		rq += stepQ;
+		if (rq >= a)
+			rq -= a;
+		if (dpow > 0) {
+			rd += stepD;
+			if (rd >= a)
+				rd -= a;
+		}
+	}
+
+	r.k = k;
+	r.num = num;
+	r.den = den;
+	r.v = v;
+	r.rp = rp;
+	r.rq = rq;
+	r.rd = rd;
+	r.s = s;
+	return k > r.N;
+}
+
+template <class MulMod>
+bool stepPiResidueWith(PiResidueState &r, int kEnd)
+{
+	switch (SERIES[r.series].dpow) {
+	case 0:
+		return stepPiResidueDpow<MulMod, 0>(r, kEnd);
+	case 1:
+		return stepPiResidueDpow<MulMod, 1>(r, kEnd);
+	default:
+		return stepPiResidueDpow<MulMod, 2>(r, kEnd);
+	}
+}
+
+bool stepPiResidue(PiResidueState &r, int kEnd)
+{
+	if (r.av > INT_MAX)
+		return stepPiResidueWith<WideMulMod>(r, kEnd);
+	if (tuning.mulMod == TuningProfile::RECIPROCAL)
+		return stepPiResidueWith<ReciprocalMulMod>(r, kEnd);
+	return stepPiResidueWith<PlainMulMod>(r, kEnd);
+}
+
+/* return the series sum mod a^vmax for the prime a, storing a^vmax in *pav */
+long long piResidue(int series, int a, int N, long long *pav)
+{
+	PiResidueState r;
+	startPiResidue(r, series, a, N);
+	stepPiResidue(r, N);
+	*pav = r.av;
+	return r.s;
+}
+
+//Fraction in [0,1) kept as base 10^9 words, most significant first.
+//Words are left unnormalized while adding so each add is a single pass.
+class DecimalFraction {
+public:
+	static const int GUARD_WORDS = 2;
+	static const unsigned long long WORD_BASE = 1000000000ull;
+
+	DecimalFraction(int digits = 0) : words((digits + 8) / 9 + GUARD_WORDS, 0) {}
+
+	/* return the bytes used by a fraction of the given width */
+	static size_t footprint(int digits) {
+		return sizeof(DecimalFraction) + sizeof(unsigned long long) * ((digits + 8) / 9 + GUARD_WORDS);
+	}
+
+	/* add s/av to the fraction, 0 <= s < av < 2^62 */
+	void add(long long s, long long av) {
+		unsigned long long r = s;
+		if (av <= INT_MAX) {
+			for (size_t i = 0; i < words.size(); i++) {
+				r *= WORD_BASE;
+				words[i] += r / av;
+				r %= av;
 			}
-			den = mul_mod(den, t, av);
-			kq2 += 2;
-
-			if (v > 0) {
-				t = inv_mod(den, av);
-				t = mul_mod(t, num, av);
-				t = mul_mod(t, k, av);
-				for (i = v; i < vmax; i++)
-					t = mul_mod(t, a, av);
-				s += t;
-				if (s >= av)
-					s -= av;
+			return;
+		}
+		//r * WORD_BASE no longer fits 64 bits: long division one bit of
+		//WORD_BASE at a time, keeping the remainder below av
+		for (size_t i = 0; i < words.size(); i++) {
+			unsigned long long q = 0, rem = 0;
+			for (int bit = 29; bit >= 0; bit--) {
+				q += q;
+				rem += rem;
+				if (rem >= (unsigned long long)av) {
+					rem -= av;
+					q++;
+				}
+				if ((WORD_BASE >> bit) & 1) {
+					rem += r;
+					if (rem >= (unsigned long long)av) {
+						rem -= av;
+						q++;
+					}
+				}
 			}
+			words[i] += q;
+			r = rem;
+		}
+	}
+	/* add another fraction of the same width */
+	void add(const DecimalFraction &other) {
+		for (size_t i = 0; i < words.size(); i++)
+			words[i] += other.words[i];
+	}
+	/* return the first m decimal digits of the fraction, integer part dropped */
+	std::string digits(int m) const {
+		std::vector<unsigned long long> w(words);
+		unsigned long long carry = 0;
+		for (size_t i = w.size(); i-- > 0;) {
+			w[i] += carry;
+			carry = w[i] / WORD_BASE;
+			w[i] %= WORD_BASE;
+		}
+		std::string out;
+		for (size_t i = 0; i < w.size() && (int)out.size() < m; i++) {
+			char buf[16];
+			snprintf(buf, sizeof(buf), "%09llu", w[i]);
+			out += buf;
+		}
+		out.resize(m);
+		return out;
+	}
+private:
+	std::vector<unsigned long long> words;
+};
+
+//Progress of a decimal digit window: the prime being worked on, how far
+//its k loop got and the partial sum of the primes already finished.  It
+//travels with its task, so the window can continue on any thread.
+struct PiDigitState {
+	int n;
+	int m;
+	PiResidueState prime;
+	DecimalFraction sum;
+
+	PiDigitState(int n, int m, int series = 0) : n(n), m(m), sum(m) {
+		const HypergeometricSeries &c = SERIES[series];
+		startPiResidue(prime, series, c.firstPrime, c.terms(n + m));
+	}
+	bool done() const {
+		return prime.a > SERIES[prime.series].primeLimit(prime.N);
+	}
+};
+
+/* advance the state for at most slice, return true once every prime is done */
+bool advancePiDigit(PiDigitState &state, std::chrono::microseconds slice)
+{
+	//The clock is checked between batches of k so short slices stay cheap
+	const int K_BATCH = 1 << 16;
+	auto start = std::chrono::steady_clock::now();
+	PiResidueState &r = state.prime;
+	while (!state.done()) {
+		if (stepPiResidue(r, r.k + K_BATCH - 1)) {
+			long long t = pow10_mod(state.n - 1, r.av);
+			state.sum.add(mul_mod_any(r.s, t, r.av), r.av);
+			startPiResidue(r, r.series, next_prime(r.a), r.N);
+		}
+		if (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start) >= slice)
+			break;
+	}
+	return state.done();
+}
+
+/* return the m decimal digits of the series' constant starting at position n, from one evaluation */
+std::string computePiDigits(int n, int m, int series = 0)
+{
+	PiDigitState state(n, m, series);
+	advancePiDigit(state, std::chrono::microseconds::max());
+	return state.sum.digits(m);
+}
+
+unsigned int computePiDigit(int n)
+{
+	return computePiDigits(n, 1)[0] - '0';
+}
 
+//Fixed-base comb table for 10^e mod av.  Row i holds 10^(j * 2^(width*i))
+//for j < 2^width, so an exponent costs one multiply per row instead of a
+//full square-and-multiply.
+class PowTable {
+public:
+	PowTable(int av, int width, int expBits) : av(av), width(width) {
+		int rows = (expBits + width - 1) / width;
+		int cols = 1 << width;
+		table.resize((size_t)rows * cols);
+		int base = 10 % av;
+		for (int i = 0; i < rows; i++) {
+			int *row = &table[(size_t)i * cols];
+			row[0] = 1 % av;
+			for (int j = 1; j < cols; j++)
+				row[j] = (int)mul_mod(row[j - 1], base, av);
+			base = (int)mul_mod(row[cols - 1], base, av);
 		}
+	}
+	/* return 10^e mod av */
+	int pow10(int e) const {
+		int cols = 1 << width;
+		int mask = cols - 1;
+		int r = 1 % av;
+		for (size_t i = 0; e != 0; i += cols, e >>= width)
+			r = (int)mul_mod(r, table[i + (e & mask)], av);
+		return r;
+	}
+	/* return the bytes used by a table with the given shape */
+	static size_t footprint(int width, int expBits) {
+		return sizeof(PowTable) + sizeof(int) * ((expBits + width - 1) / width) * ((size_t)1 << width);
+	}
+private:
+	int av;
+	int width;
+	std::vector<int> table;
+};
 
-		t = pow_mod(10, n - 1, av);
-		s = mul_mod(s, t, av);
-		sum = std::fmod(sum + (double)s / (double)av, 1.0);
+/* return the comb width minimizing build plus query multiplies within budget, 0 if no table fits */
+int chooseCombWidth(size_t numPrimes, size_t numPositions, int expBits, size_t budgetBytes)
+{
+	int best = 0;
+	double bestCost = 0;
+	for (int w = 1; w <= 12; w++) {
+		size_t rows = (expBits + w - 1) / w;
+		if (numPrimes * PowTable::footprint(w, expBits) > budgetBytes)
+			break;
+		double cost = (double)numPrimes * ((double)rows * ((size_t)1 << w) + (double)numPositions * rows);
+		if (best == 0 || cost < bestCost) {
+			best = w;
+			bestCost = cost;
+		}
 	}
+	return best;
+}
+
+//Per-prime residue of the series, shared by every position of a batch
+struct PrimeResidue {
+	int a;
+	long long av;
+	long long s;
+};
+
+//Residues for every prime up to 2N plus their comb tables.  Built once
+//for a batch of positions, then read concurrently by the workers.
+class ResidueTable {
+public:
+	static const size_t COMB_BUDGET = (size_t)64 << 20;
+
+	/* return the bytes of a table without comb tables, from the prime count estimate */
+	static size_t footprint(int maxPosition, int m, int series = 0) {
+		const HypergeometricSeries &c = SERIES[series];
+		double limit = std::max(3, c.primeLimit(c.terms(maxPosition + m)));
+		return sizeof(ResidueTable) + (size_t)(limit / (std::log(limit) - 1.1) + 16) * sizeof(PrimeResidue);
+	}
+
+	ResidueTable(int maxPosition, int m, size_t numPositions, int numThreads, int series = 0) {
+		const HypergeometricSeries &c = SERIES[series];
+		N = c.terms(maxPosition + m);
+		reservation.reserve(footprint(maxPosition, m, series));
+		for (int a = c.firstPrime; a <= c.primeLimit(N); a = next_prime(a))
+			primes.push_back(PrimeResidue{ a, 0, 0 });
+
+		//Comb tables get what the governor can spare, up to COMB_BUDGET
+		int expBits = 1;
+		while (expBits < 31 && (maxPosition >> expBits) != 0)
+			expBits++;
+		size_t combBudget = std::min((size_t)COMB_BUDGET, MemoryGovernor::instance().available());
+		combWidth = chooseCombWidth(primes.size(), numPositions, expBits, combBudget);
+		if (combWidth > 0) {
+			reservation.reserve(primes.size() * PowTable::footprint(combWidth, expBits));
+			pows.resize(primes.size());
+		}
+
+		//Primes are handed out in small blocks so large and small a balance out
+		std::mutex nextMutex;
+		size_t next = 0;
+		auto build = [&]()
+		{
+			profileThread("table");
+			while (true) {
+				nextMutex.lock();
+				size_t first = next;
+				next += 64;
+				nextMutex.unlock();
+				if (first >= primes.size())
+					break;
+				size_t last = std::min(first + 64, primes.size());
+				for (size_t i = first; i < last; i++) {
+					PrimeResidue &p = primes[i];
+					p.s = piResidue(series, p.a, N, &p.av);
+					if (combWidth > 0 && p.av <= INT_MAX)
+						pows[i].reset(new PowTable(p.av, combWidth, expBits));
+				}
+			}
+		};
+		std::vector<std::thread> threads;
+		for (int i = 0; i < numThreads; i++)
+			threads.push_back(std::thread(build));
+		for (auto &t : threads)
+			t.join();
+	}
+	/* return 10^e mod av for the i'th prime */
+	long long pow10(size_t i, int e) const {
+		if (combWidth > 0 && pows[i])
+			return pows[i]->pow10(e);
+		return pow10_mod(e, primes[i].av);
+	}
+
+	std::vector<PrimeResidue> primes;
+private:
+	int N;
+	int combWidth;
+	std::vector<std::unique_ptr<PowTable>> pows;
+	MemoryReservation reservation;
+};
+
+/* return the m decimal digits of pi starting at position n, using a prebuilt residue table */
+std::string computePiDigitsAt(const ResidueTable &table, int n, int m)
+{
+	DecimalFraction sum(m);
+	for (size_t i = 0; i < table.primes.size(); i++) {
+		const PrimeResidue &p = table.primes[i];
+		long long t = table.pow10(i, n - 1);
+		sum.add(mul_mod_any(p.s, t, p.av), p.av);
+	}
+	return sum.digits(m);
+}
+
+/* add the residue of prime a to the accumulator of every position */
+void addPrimeToPositions(int series, int a, int N, const std::vector<int> &positions, int combWidth, int expBits,
+	std::vector<DecimalFraction> &sums)
+{
+	long long av;
+	long long s = piResidue(series, a, N, &av);
+	std::unique_ptr<PowTable> pows;
+	if (combWidth > 0 && av <= INT_MAX)
+		pows.reset(new PowTable((int)av, combWidth, expBits));
+	for (size_t i = 0; i < positions.size(); i++) {
+		long long t = pows ? pows->pow10(positions[i] - 1) : pow10_mod(positions[i] - 1, av);
+		sums[i].add(mul_mod_any(s, t, av), av);
+	}
+}
 
-	return static_cast<unsigned int>(sum * 1e9 / 100000000);
+/* return the m digits at each position, streaming over primes without storing a residue table */
+std::vector<std::string> computePiDigitsStreaming(const std::vector<int> &positions, int m, int numThreads, int series = 0)
+{
+	const HypergeometricSeries &c = SERIES[series];
+	int maxPosition = *std::max_element(positions.begin(), positions.end());
+	int N = c.terms(maxPosition + m);
+	int expBits = 1;
+	while (expBits < 31 && (maxPosition >> expBits) != 0)
+		expBits++;
+	//A throwaway comb table only pays off when enough positions share the prime
+	int combWidth = chooseCombWidth(1, positions.size(), expBits, (size_t)1 << 16);
+	if (positions.size() < 8)
+		combWidth = 0;
+
+	//Each thread owns a row of accumulators, merged once at the end.  Use
+	//fewer threads rather than more rows than the budget allows, and when
+	//not even one row fits, stream the positions in batches that do, at the
+	//cost of one pass over the primes per batch.
+	size_t row = positions.size() * DecimalFraction::footprint(m);
+	size_t batch = MemoryGovernor::instance().available() / DecimalFraction::footprint(m);
+	if (batch < positions.size() && positions.size() > 1) {
+		batch = std::max<size_t>(1, batch);
+		std::vector<std::string> digits;
+		for (size_t i = 0; i < positions.size(); i += batch) {
+			std::vector<int> part(positions.begin() + i, positions.begin() + std::min(positions.size(), i + batch));
+			std::vector<std::string> partDigits = computePiDigitsStreaming(part, m, numThreads, series);
+			digits.insert(digits.end(), partDigits.begin(), partDigits.end());
+		}
+		return digits;
+	}
+	numThreads = (int)std::max<size_t>(1, std::min<size_t>(numThreads, MemoryGovernor::instance().available() / row));
+	MemoryReservation reservation;
+	reservation.reserve(numThreads * row);
+	std::vector<std::vector<DecimalFraction>> sums(numThreads,
+		std::vector<DecimalFraction>(positions.size(), DecimalFraction(m)));
+	std::mutex primeMutex;
+	int nextA = c.firstPrime;
+	int limit = c.primeLimit(N);
+	auto worker = [&](int which)
+	{
+		profileThread("stream");
+		std::vector<DecimalFraction> &mine = sums[which];
+		while (true) {
+			primeMutex.lock();
+			int a = nextA;
+			if (a <= limit)
+				nextA = next_prime(a);
+			primeMutex.unlock();
+			if (a > limit)
+				break;
+			addPrimeToPositions(series, a, N, positions, combWidth, expBits, mine);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i = 0; i < numThreads; i++)
+		threads.push_back(std::thread(worker, i));
+	for (auto &t : threads)
+		t.join();
+
+	std::vector<std::string> digits;
+	for (size_t i = 0; i < positions.size(); i++) {
+		for (int j = 1; j < numThreads; j++)
+			sums[0][i].add(sums[j][i]);
+		digits.push_back(sums[0][i].digits(m));
+	}
+	return digits;
 }
 
 // ------------------------------------------------------------------
@@ -181,63 +1276,477 @@ unsigned int computePiDigit(int n)
 // Code adapted from this source: https://web.archive.org/web/20150627225748/http://en.literateprograms.org/Pi_with_the_BBP_formula_%28Python%29
 //
 // ------------------------------------------------------------------
-double powneg(unsigned long long b, long long pow)
+const unsigned long long HEX_D = 14;
+const unsigned long long HEX_M = 1ull << (4 * HEX_D);
+const unsigned long long HEX_SHIFT = 4 * HEX_D;
+const unsigned long long HEX_MASK = HEX_M - 1;
+
+/* return (a * b) mod r for a, b < r, in 64 bits while r <= 2^32.  Past
+   position 5.3e8 the moduli 8k + j outgrow that; the fixed point split
+   below holds up to r < 2^36, past any int position. */
+inline unsigned long long mul16_mod(unsigned long long a, unsigned long long b, unsigned long long r)
+{
+	return r <= (1ull << 32) ? a * b % r : (unsigned long long)mul_mod_wide((long long)a, (long long)b, (long long)r);
+}
+
+/* return how many leading hex digits of an evaluation at position n are
+   exact.  Each of the ~n head terms is truncated by under one unit in the
+   last place, so log2(n) low bits and a guard digit are lost; 8 up to
+   about 1.6e7, 5 at the far end of an int. */
+int hexReliableDigits(unsigned long long n)
+{
+	return std::min(8, (int)(HEX_SHIFT - 4 - std::ceil(std::log2((double)n + 2))) / 4);
+}
+
+/* return (16^e) mod r */
+unsigned long long pow16_mod(unsigned long long e, unsigned long long r)
+{
+	unsigned long long x = 1 % r, b = 16 % r;
+	while (e != 0) {
+		if (e & 1)
+			x = mul16_mod(x, b, r);
+		b = mul16_mod(b, b, r);
+		e >>= 1;
+	}
+	return x;
+}
+
+/* return term k <= n of the series j as a fixed point fraction */
+unsigned long long hexHeadTerm(unsigned long long j, unsigned long long n, unsigned long long k)
+{
+	unsigned long long r = 8 * k + j;
+	unsigned long long v = pow16_mod(n - k, r);
+	//v << HEX_SHIFT needs more than 64 bits, so divide in two halves
+	unsigned long long hi = (v << (HEX_SHIFT / 2)) / r;
+	unsigned long long rem = (v << (HEX_SHIFT / 2)) % r;
+	return (hi << (HEX_SHIFT / 2)) + (rem << (HEX_SHIFT / 2)) / r;
+}
+
+/* return the sum of the head terms k0 <= k < k1 of the series j */
+unsigned long long hexHeadRange(unsigned long long j, unsigned long long n, unsigned long long k0, unsigned long long k1)
+{
+	unsigned long long s = 0;
+	for (unsigned long long k = k0; k < k1; k++)
+		s = (s + hexHeadTerm(j, n, k)) & HEX_MASK;
+	return s;
+}
+
+/* return the sum of the terms k > n of the series j, stopping once they vanish */
+unsigned long long hexTail(unsigned long long j, unsigned long long n)
+{
+	unsigned long long t = 0;
+	for (unsigned long long k = n + 1; 4 * (k - n) < HEX_SHIFT; k++)
+		t += (HEX_M >> (4 * (k - n))) / (8 * k + j);
+	return t;
+}
+
+//Progress of a hex digit: which of the four BBP series is running, the
+//term k it reached, its partial sum and the weighted total of the series
+//already finished.
+struct HexDigitState {
+	static const int SERIES = 4;
+
+	unsigned long long n;
+	int series;
+	unsigned long long k;
+	unsigned long long s;
+	unsigned long long x;
+
+	HexDigitState(unsigned long long position) : n(position - 1), series(0), k(0), s(0), x(0) {}
+
+	static unsigned long long j(int series) {
+		static const unsigned long long J[SERIES] = { 1, 4, 5, 6 };
+		return J[series];
+	}
+	static unsigned long long weight(int series) {
+		static const unsigned long long W[SERIES] = { 4, (unsigned long long)-2, (unsigned long long)-1, (unsigned long long)-1 };
+		return W[series];
+	}
+	bool done() const {
+		return series >= SERIES;
+	}
+	unsigned long long value() const {
+		return x & HEX_MASK;
+	}
+};
+
+/* advance the state for at most slice, return true once all four series are done */
+bool advanceHexDigit(HexDigitState &state, std::chrono::microseconds slice)
+{
+	const unsigned long long K_BATCH = 1 << 16;
+	auto start = std::chrono::steady_clock::now();
+	while (!state.done()) {
+		unsigned long long j = HexDigitState::j(state.series);
+		unsigned long long kEnd = std::min(state.k + K_BATCH, state.n + 1);
+		state.s = (state.s + hexHeadRange(j, state.n, state.k, kEnd)) & HEX_MASK;
+		state.k = kEnd;
+		if (state.k > state.n) {
+			state.x += HexDigitState::weight(state.series) * (state.s + hexTail(j, state.n));
+			state.series++;
+			state.k = 0;
+			state.s = 0;
+		}
+		if (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start) >= slice)
+			break;
+	}
+	return state.done();
+}
+
+unsigned long long piDigitHex(unsigned long long n)
+{
+	HexDigitState state(n);
+	advanceHexDigit(state, std::chrono::microseconds::max());
+	return state.value();
+}
+
+const int HEX_LANES = 8;
+
+/* piDigitHex for the HEX_LANES positions n + l*stride at once.  The lanes
+   share k, the modulus 8k + j and one modular power per term; lane l's
+   power is lane l-1's times 16^stride, so each term costs two modular
+   powers plus a multiply per lane instead of a power per lane.  The
+   64-bit divisions by r are not vectorizable; the gain is the shared
+   exponentiation, not SIMD. */
+void piDigitHexLanes(unsigned long long n, unsigned long long stride, unsigned long long out[HEX_LANES])
+{
+	unsigned long long x[HEX_LANES] = { 0 };
+	unsigned long long v[HEX_LANES], s[HEX_LANES];
+	n -= 1;
+
+	for (int i = 0; i < HexDigitState::SERIES; i++) {
+		unsigned long long j = HexDigitState::j(i);
+		for (int l = 0; l < HEX_LANES; l++)
+			s[l] = 0;
+
+		//Terms every lane has in its head: k <= n
+		for (unsigned long long k = 0; k <= n; k++) {
+			unsigned long long r = 8 * k + j;
+			unsigned long long step = pow16_mod(stride, r);
+			v[0] = pow16_mod(n - k, r);
+			for (int l = 1; l < HEX_LANES; l++)
+				v[l] = mul16_mod(v[l - 1], step, r);
+			for (int l = 0; l < HEX_LANES; l++) {
+				unsigned long long hi = (v[l] << (HEX_SHIFT / 2)) / r;
+				unsigned long long rem = (v[l] << (HEX_SHIFT / 2)) % r;
+				s[l] += (hi << (HEX_SHIFT / 2)) + (rem << (HEX_SHIFT / 2)) / r;
+			}
+		}
+
+		//The rest of each deeper lane's head, then every lane's tail
+		for (int l = 0; l < HEX_LANES; l++) {
+			unsigned long long nl = n + l * stride;
+			s[l] += hexHeadRange(j, nl, n + 1, nl + 1) + hexTail(j, nl);
+			x[l] += HexDigitState::weight(i) * s[l];
+		}
+	}
+	for (int l = 0; l < HEX_LANES; l++)
+		out[l] = x[l] & HEX_MASK;
+}
+
+/* piDigitHex with the head terms of every series split across threads */
+unsigned long long piDigitHexParallel(unsigned long long n, int numThreads)
+{
+	n -= 1;
+	std::vector<unsigned long long> partial(numThreads, 0);
+	auto worker = [&](int which)
+	{
+		profileThread("hex");
+		unsigned long long k0 = (n + 1) * which / numThreads;
+		unsigned long long k1 = (n + 1) * (which + 1) / numThreads;
+		for (int i = 0; i < HexDigitState::SERIES; i++)
+			partial[which] += HexDigitState::weight(i) * hexHeadRange(HexDigitState::j(i), n, k0, k1);
+	};
+	std::vector<std::thread> threads;
+	for (int i = 0; i < numThreads; i++)
+		threads.push_back(std::thread(worker, i));
+	for (auto &t : threads)
+		t.join();
+
+	unsigned long long x = 0;
+	for (int i = 0; i < HexDigitState::SERIES; i++)
+		x += HexDigitState::weight(i) * hexTail(HexDigitState::j(i), n);
+	for (unsigned long long p : partial)
+		x += p;
+	return x & HEX_MASK;
+}
+
+/* return the first h hex digits of the fraction 0.decimal */
+std::string decimalToHex(const std::string &decimal, int h)
+{
+	//Base 10^9 words, most significant first, times 16 per hex digit
+	std::vector<unsigned long long> words((decimal.size() + 8) / 9, 0);
+	for (size_t i = 0; i < decimal.size(); i++)
+		words[i / 9] = words[i / 9] * 10 + (decimal[i] - '0');
+	if (decimal.size() % 9 != 0)
+		for (size_t i = decimal.size() % 9; i < 9; i++)
+			words.back() *= 10;
+
+	static const char HEX[] = "0123456789abcdef";
+	std::string out;
+	for (int d = 0; d < h; d++) {
+		unsigned long long carry = 0;
+		for (size_t i = words.size(); i-- > 0;) {
+			words[i] = words[i] * 16 + carry;
+			carry = words[i] / 1000000000ull;
+			words[i] %= 1000000000ull;
+		}
+		out += HEX[carry];
+	}
+	return out;
+}
+
+//Result of checking decimal digits against BBP hex digits
+struct HexCheck {
+	int first;
+	int count;
+	std::string expected;
+	std::string computed;
+	bool pass() const {
+		return expected == computed;
+	}
+};
+
+/* check the tail of a decimal prefix of pi by converting it to hex and comparing with BBP */
+HexCheck verifyWithHex(const std::string &decimal, int numThreads)
+{
+	//Hex digits of a d digit decimal fraction are exact up to about d*log16(10)
+	const int CHECK_DIGITS = 8;
+	HexCheck check;
+	int reliable = (int)(decimal.size() * std::log(10) / std::log(16)) - 3;
+	check.count = std::min(std::min(CHECK_DIGITS, reliable), hexReliableDigits(reliable));
+	check.first = reliable - check.count + 1;
+	if (check.count < 1)
+		return check;
+
+	//BBP runs on the other cores while this thread does the radix conversion
+	unsigned long long bbp = 0;
+	int first = check.first;
+	std::thread bbpThread([&bbp, first, numThreads]() { bbp = piDigitHexParallel(first, std::max(1, numThreads - 1)); });
+	check.computed = decimalToHex(decimal, reliable).substr(check.first - 1);
+	bbpThread.join();
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%014llx", bbp);
+	check.expected = std::string(buf).substr(0, check.count);
+	return check;
+}
+
+
+
+/* return the seconds taken by f */
+template <class F>
+double timeIt(F f)
 {
-	double r = std::pow(b, -pow);
-	return 1.0 / r;
+	auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
-unsigned long long s(unsigned long long j, unsigned long long n)
+/* return work units per second with one pinned copy of work per CPU in cpus */
+template <class F>
+double pinnedRate(const std::vector<int> &cpus, F work)
 {
-	const unsigned long long D = 14;
-	const unsigned long long M = static_cast<unsigned long long>(std::pow(16, D));
-	const unsigned long long SHIFT = 4 * D;
-	const unsigned long long MASK = M - 1;
+	double seconds = timeIt([&]() {
+		std::vector<std::thread> threads;
+		for (int cpu : cpus)
+			threads.push_back(std::thread([cpu, &work]() { pinThread(cpu); work(); }));
+		for (auto &t : threads)
+			t.join();
+	});
+	return cpus.size() / seconds;
+}
 
-	unsigned long long s = 0;
-	unsigned long long k = 0;
-	while (k <= n)
-	{
-		unsigned long long r = 8 * k + j;
-		unsigned long long v = static_cast<unsigned long long>(std::pow(16ul, n - k)) % r;
-		s = (s + (v << SHIFT) / r) & MASK;
-		k += 1;
-	}
-	unsigned long long t = 0;
-	k = n + 1;
-	while (true)
-	{
-		unsigned long long xp = static_cast<unsigned long long>(powneg(16, n - k) * M);
-		unsigned long long newt = t + xp / (8 * k + j);
-		if (t == newt)
-			break;
-		else
-			t = newt;
-		k += 1;
+/* benchmark the alternatives on this machine and write the tuning profile */
+void runTuning()
+{
+	std::ostringstream notes;
+
+	//Backend: the k loop for a spread of primes at a representative depth
+	const int N = (int)((10000 + 20) * std::log(10) / std::log(2));
+	std::vector<int> sample;
+	for (int a = 3; a <= 2 * N; a = next_prime(a + 97))
+		sample.push_back(a);
+	int plainSum = 0, reciprocalSum = 0;
+	double plain = timeIt([&]() {
+		for (int a : sample) {
+			PiResidueState r;
+			startPiResidue(r, 0, a, N);
+			stepPiResidueWith<PlainMulMod>(r, N);
+			plainSum += r.s;
+		}
+	});
+	double reciprocal = timeIt([&]() {
+		for (int a : sample) {
+			PiResidueState r;
+			startPiResidue(r, 0, a, N);
+			stepPiResidueWith<ReciprocalMulMod>(r, N);
+			reciprocalSum += r.s;
+		}
+	});
+	notes << "# mulmod plain " << plain << "s, reciprocal " << reciprocal << "s\n";
+	tuning.mulMod = reciprocal < plain && reciprocalSum == plainSum ? TuningProfile::RECIPROCAL : TuningProfile::PLAIN;
+
+	//SMT: siblings share the divider, so they are only used for an engine
+	//when running on every logical CPU beats one per core by 5%
+	CpuTopology topology = CpuTopology::read();
+	if (topology.physicalCores() < (int)topology.cpus.size()) {
+		auto decimal = [&]() {
+			for (size_t i = 0; i < sample.size(); i += 8) {
+				PiResidueState r;
+				startPiResidue(r, 0, sample[i], N);
+				stepPiResidue(r, N);
+			}
+		};
+		auto hex = []() { hexHeadRange(1, 200000, 0, 20000); };
+		double coresDecimal = pinnedRate(topology.placement(false), decimal);
+		double allDecimal = pinnedRate(topology.placement(true), decimal);
+		double coresHex = pinnedRate(topology.placement(false), hex);
+		double allHex = pinnedRate(topology.placement(true), hex);
+		notes << "# smt decimal " << coresDecimal << " vs " << allDecimal << "/s, hex " << coresHex << " vs " << allHex << "/s\n";
+		tuning.smtDecimal = allDecimal > 1.05 * coresDecimal;
+		tuning.smtHex = allHex > 1.05 * coresHex;
 	}
 
-	return s + t;
+	std::cout << notes.str();
+	if (tuning.save(TUNING_FILE, notes.str()))
+		std::cout << "Wrote " << TUNING_FILE << "\n";
+	else
+		std::cerr << "Cannot write " << TUNING_FILE << "\n";
 }
 
-unsigned long long piDigitHex(unsigned long long n)
+/* return count hex digits of pi starting at position n, 8 per BBP evaluation */
+std::string piHexDigits(int n, int count)
 {
-	const unsigned long long D = 14;
-	const unsigned long long M = static_cast<unsigned long long>(std::pow(16, D));
-	const unsigned long long SHIFT = 4 * D;
-	const unsigned long long MASK = M - 1;
+	const int RELIABLE = hexReliableDigits((unsigned long long)n + count);
+	std::string out;
+	for (int i = 0; i < count; i += RELIABLE * HEX_LANES) {
+		unsigned long long x[HEX_LANES];
+		int lanes = std::min(HEX_LANES, (count - i + RELIABLE - 1) / RELIABLE);
+		if (lanes > 1)
+			piDigitHexLanes(n + i, RELIABLE, x);
+		else
+			x[0] = piDigitHex(n + i);
+		for (int l = 0; l < lanes; l++) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%014llx", x[l]);
+			out += std::string(buf).substr(0, std::min(RELIABLE, count - i - l * RELIABLE));
+		}
+	}
+	return out;
+}
 
-	n -= 1;
-	unsigned long long x = (4 * s(1, n) - 2 * s(4, n) - s(5, n) - s(6, n)) & MASK;
+//Progress of a window of hex digits for time sliced runs: the digits
+//finished so far and the BBP evaluation producing the next ones.  Slices
+//evaluate one position at a time, without the lanes of piHexDigits.
+struct HexWindowState {
+	int n;
+	int count;
+	std::string digits;
+	HexDigitState position;
+
+	HexWindowState(int n, int count) : n(n), count(count), position(n) {}
+	bool done() const {
+		return (int)digits.size() >= count;
+	}
+};
 
-	return x;
+/* advance the window for at most slice, return true once every digit is in */
+bool advanceHexWindow(HexWindowState &state, std::chrono::microseconds slice)
+{
+	const int RELIABLE = hexReliableDigits((unsigned long long)state.n + state.count);
+	auto start = std::chrono::steady_clock::now();
+	while (!state.done()) {
+		auto left = slice - std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		if (left.count() <= 0 || !advanceHexDigit(state.position, left))
+			break;
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%014llx", state.position.value());
+		state.digits += std::string(buf).substr(0, std::min(RELIABLE, state.count - (int)state.digits.size()));
+		state.position = HexDigitState(state.n + state.digits.size());
+	}
+	return state.done();
 }
 
+//Hash table to store result
+class PieTable {
+public:
+	void lock() {
+		hashMutex.lock();
+	}
+	void unlock() {
+		hashMutex.unlock();
+	}
+	void insertValue(int key,const std::string &value) {
+		pieMap.insert({ key, value });
+	}
+	std::string get(int index) {
+		return pieMap[index];
+	}
+private:
+	std::mutex hashMutex;
+	std::unordered_map<int,std::string> pieMap;
+
+};
 
+struct Job;
 
 struct Task {
 	int id;
-	unsigned int computePi() {
-		return computePiDigit(id);
+	int count;
+	int series;
+	bool hex;
+	const ResidueTable *table;
+	PieTable *results;
+	Job *job;
+	std::shared_ptr<PiDigitState> state;
+	std::shared_ptr<HexWindowState> hexState;
+
+	Task(int id, int count, PieTable *results, int series = 0, const ResidueTable *table = nullptr,
+		Job *job = nullptr, bool hex = false)
+		: id(id), count(count), series(series), hex(hex), table(table), results(results), job(job) {}
+
+	std::string computePi() {
+		if (hex)
+			return piHexDigits(id, count);
+		if (table != nullptr)
+			return computePiDigitsAt(*table, id, count);
+		if (count == 1 && series == 0)
+			return std::to_string(computePiDigit(id));
+		return computePiDigits(id, count, series);
+	}
+	/* return true once a slice of the task has run */
+	bool started() const {
+		return state || hexState;
+	}
+	/* run for at most slice, return true with the digits once finished; progress
+	   travels with the task.  Table lookups are linear and run whole. */
+	bool computeSlice(std::chrono::microseconds slice, std::string &digits) {
+		if (table != nullptr) {
+			digits = computePi();
+			return true;
+		}
+		if (hex) {
+			if (!hexState)
+				hexState = std::make_shared<HexWindowState>(id, count);
+			if (!advanceHexWindow(*hexState, slice))
+				return false;
+			digits = hexState->digits;
+			return true;
+		}
+		if (!state)
+			state = std::make_shared<PiDigitState>(id, count, series);
+		if (!advancePiDigit(*state, slice))
+			return false;
+		digits = state->sum.digits(count);
+		return true;
+	}
+	/* return the relative cost of the task: BBP and table lookups grow
+	   linearly with depth, a window evaluated from scratch quadratically */
+	double work() const {
+		double depth = (double)id + count;
+		if (hex || table != nullptr)
+			return depth * count;
+		return depth * depth;
 	}
 };
 
@@ -249,11 +1758,15 @@ struct piDigitEntry {
 
 
 
-//Task queue for threads
+//Task queue for threads.  The depth can be read without the lock, and the
+//position of every task pushed fresh (not a requeued slice) is kept.
 class TaskList {
 public:
 	void push(Task task) {
+		if (!task.started())
+			pushed.push_back(task.id);
 		piQueue.push(task);
+		queueDepth.store(piQueue.size());
 	}
 	void lock() {
 		queueMutex.lock();
@@ -266,96 +1779,1330 @@ public:
 	}
 
 	int getPieDigit() {
-		piQueue.front().id;
+		return piQueue.front().id;
 	}
 	Task getTask() {
 		return piQueue.front();
 	}
 	void pop() {
 		piQueue.pop();
+		queueDepth.store(piQueue.size());
+	}
+	size_t depth() const {
+		return queueDepth.load();
+	}
+	std::vector<int> ids() {
+		std::lock_guard<std::mutex> guard(queueMutex);
+		return pushed;
 	}
 private:
 	std::queue<Task> piQueue;	
 	std::mutex queueMutex;
+	std::atomic<size_t> queueDepth{ 0 };
+	std::vector<int> pushed;
 };
 
-//Hash table to store result
-class PieTable {
+//One request from a job file: the windows to compute, how, and where the
+//digits go.  Workers stamp its first start and last finish for timing.
+struct Job {
+	std::string name;
+	bool sparse = false;
+	std::vector<std::pair<int, int>> windows;
+	int series = 0;
+	bool hex = false;
+	std::string engine = "table";
+	std::string out = "-";
+	PieTable results;
+
+	void taskStarted() {
+		timeMutex.lock();
+		if (!started) {
+			started = true;
+			startTime = std::chrono::steady_clock::now();
+		}
+		timeMutex.unlock();
+	}
+	void taskFinished() {
+		timeMutex.lock();
+		finishTime = std::chrono::steady_clock::now();
+		timeMutex.unlock();
+	}
+	double seconds() {
+		return std::chrono::duration<double>(finishTime - startTime).count();
+	}
+	/* return the last digit position plus one over all windows */
+	int end() const {
+		int e = 0;
+		for (auto &w : windows)
+			e = std::max(e, w.first + w.second);
+		return e;
+	}
+private:
+	std::mutex timeMutex;
+	bool started = false;
+	std::chrono::steady_clock::time_point startTime, finishTime;
+};
+
+//Blocks in flight across every process on the host, in a POSIX shared
+//memory table keyed by block.  The first process to claim a block computes
+//it and publishes the digits into the slot; others wait on a futex for the
+//result instead of computing it again.  A claim whose owner has died is
+//taken over by the next waiter.  The table only grows: once a probe finds
+//no free slot the block is computed privately.  A header records the
+//format; a table left by a build with a different one is replaced.
+class SharedBlockTable {
 public:
-	void lock() {
-		hashMutex.lock();
+	static const int NUM_SLOTS = 1 << 16;
+	static const int MAX_PROBES = 32;
+	static const int RESULT_DIGITS = 100;
+	static const int WAIT_MS = 100;
+	static const unsigned MAGIC = 0x70696274;
+	static const unsigned VERSION = 1;
+	static const int OPEN_ATTEMPTS = 3;
+	static const int INIT_WAITS = 1000;
+
+	enum Acquire { COMPUTE, PUBLISHED, PRIVATE };
+
+	/* return the host-wide table, creating it on first use, or nullptr if unavailable */
+	static std::unique_ptr<SharedBlockTable> open(const char *name) {
+#ifdef __linux__
+		for (int attempt = 0; attempt < OPEN_ATTEMPTS; attempt++) {
+			bool stale = false;
+			Layout *layout = attach(name, stale);
+			if (layout != nullptr) {
+				std::unique_ptr<SharedBlockTable> table(new SharedBlockTable());
+				table->layout = layout;
+				return table;
+			}
+			if (!stale)
+				return nullptr;
+			//Processes still attached keep the old object; new ones get a fresh table
+			shm_unlink(name);
+		}
+		return nullptr;
+#else
+		(void)name;
+		return nullptr;
+#endif
 	}
-	void unlock() {
-		hashMutex.unlock();
+	~SharedBlockTable() {
+#ifdef __linux__
+		munmap(layout, sizeof(Layout));
+#endif
 	}
-	void insertValue(int key,unsigned int value) {
-		pieMap.insert({ key, value });
+
+	/* return the key of a block, 0 if its digits do not fit a slot */
+	static unsigned long long key(int id, int count, int series, bool hex) {
+		if (count > RESULT_DIGITS)
+			return 0;
+		return ((unsigned long long)id << 16 | (unsigned long long)count << 8 | (hex ? 0x80 : 0) | series) + 1;
 	}
-	int get(int index) {
-		return pieMap[index];
+	/* find or claim the block.  PUBLISHED fills digits, COMPUTE means the
+	   caller owns the claim and must publish, PRIVATE means no slot. */
+	Acquire acquire(unsigned long long k, std::string &digits) {
+#ifdef __linux__
+		Slot *slot = find(k, true);
+		if (slot == nullptr)
+			return PRIVATE;
+		int self = getpid();
+		int none = 0;
+		if (slot->owner.compare_exchange_strong(none, self)) {
+			slot->state.store(CLAIMED);
+			return COMPUTE;
+		}
+		claims++;
+		for (int waits = 0; ; waits++) {
+			unsigned state = slot->state.load(std::memory_order_acquire);
+			if (state == DONE) {
+				digits.assign(slot->digits, slot->length);
+				hits++;
+				return PUBLISHED;
+			}
+			//Take over a claim whose owner is gone, or one that never
+			//got past setting its key
+			int owner = slot->owner.load();
+			bool stale = owner == 0 ? waits > 0 : owner != self && kill(owner, 0) != 0 && errno == ESRCH;
+			if (stale && slot->owner.compare_exchange_strong(owner, self)) {
+				slot->state.store(CLAIMED);
+				reclaims++;
+				return COMPUTE;
+			}
+			struct timespec timeout = { 0, WAIT_MS * 1000000L };
+			syscall(SYS_futex, &slot->state, FUTEX_WAIT, state, &timeout, nullptr, 0);
+		}
+#else
+		(void)k;
+		(void)digits;
+		return PRIVATE;
+#endif
+	}
+	/* publish the digits of a block claimed through acquire and wake its waiters */
+	void publish(unsigned long long k, const std::string &digits) {
+#ifdef __linux__
+		Slot *slot = find(k, false);
+		if (slot == nullptr || slot->owner.load() != getpid())
+			return;
+		slot->length = (unsigned)std::min(digits.size(), (size_t)RESULT_DIGITS);
+		std::memcpy(slot->digits, digits.data(), slot->length);
+		slot->state.store(DONE, std::memory_order_release);
+		syscall(SYS_futex, &slot->state, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+		(void)k;
+		(void)digits;
+#endif
+	}
+	/* write how often blocks were found in flight, reused or taken over */
+	void report(std::ostream &out) const {
+		out << "Shared blocks: " << claims << " already claimed, " << hits << " reused, " << reclaims << " reclaimed\n";
 	}
 private:
-	std::mutex hashMutex;
-	std::unordered_map<int,unsigned int> pieMap;
+	enum State { EMPTY, CLAIMED, DONE };
+
+	struct Slot {
+		std::atomic<unsigned long long> key;
+		std::atomic<unsigned> state;
+		std::atomic<int> owner;
+		unsigned length;
+		char digits[RESULT_DIGITS];
+	};
+	//magic is 0 in a new object, INITIALIZING while its creator fills in
+	//the rest and MAGIC once the header can be read
+	struct Header {
+		std::atomic<unsigned> magic;
+		unsigned version;
+		unsigned slots;
+		unsigned resultDigits;
+		unsigned slotBytes;
+	};
+	struct Layout {
+		Header header;
+		Slot slots[NUM_SLOTS];
+	};
+	static const unsigned INITIALIZING = 1;
+
+	SharedBlockTable() : layout(nullptr), claims(0), hits(0), reclaims(0) {}
+
+#ifdef __linux__
+	/* return the mapped table, or nullptr with stale set if the object there
+	   has another size or format */
+	static Layout *attach(const char *name, bool &stale) {
+		int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			return nullptr;
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return nullptr;
+		}
+		if (st.st_size != 0 && st.st_size != (off_t)sizeof(Layout)) {
+			close(fd);
+			stale = true;
+			return nullptr;
+		}
+		//A freshly extended object reads as zeros, which is an empty table
+		if (ftruncate(fd, sizeof(Layout)) != 0) {
+			close(fd);
+			return nullptr;
+		}
+		void *memory = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (memory == MAP_FAILED)
+			return nullptr;
+
+		Layout *layout = (Layout *)memory;
+		Header &header = layout->header;
+		unsigned magic = 0;
+		if (header.magic.compare_exchange_strong(magic, INITIALIZING)) {
+			header.version = VERSION;
+			header.slots = NUM_SLOTS;
+			header.resultDigits = RESULT_DIGITS;
+			header.slotBytes = sizeof(Slot);
+			header.magic.store(MAGIC, std::memory_order_release);
+			return layout;
+		}
+		//Give the creator a second to finish; past that it has died
+		for (int waits = 0; magic == INITIALIZING && waits < INIT_WAITS; waits++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			magic = header.magic.load(std::memory_order_acquire);
+		}
+		if (magic == MAGIC && header.version == VERSION && header.slots == NUM_SLOTS &&
+			header.resultDigits == RESULT_DIGITS && header.slotBytes == sizeof(Slot))
+			return layout;
+		munmap(memory, sizeof(Layout));
+		stale = true;
+		return nullptr;
+	}
+#endif
+
+	/* return the slot holding k, claiming a free one on the way when asked */
+	Slot *find(unsigned long long k, bool insert) {
+		size_t start = (size_t)((k * 0x9e3779b97f4a7c15ull) >> 48);
+		for (int i = 0; i < MAX_PROBES; i++) {
+			Slot &slot = layout->slots[(start + i) % NUM_SLOTS];
+			unsigned long long found = slot.key.load();
+			if (found == 0 && insert && slot.key.compare_exchange_strong(found, k))
+				return &slot;
+			if (found == k)
+				return &slot;
+			if (found == 0 && !insert)
+				return nullptr;
+		}
+		return nullptr;
+	}
 
+	Layout *layout;
+	std::atomic<int> claims, hits, reclaims;
 };
 
+const char *SHARED_BLOCKS = "/pi_blocks";
+std::unique_ptr<SharedBlockTable> sharedBlocks;
 
+//Set from the SIGUSR1 handler, answered by the pool's watching thread
+std::atomic<bool> snapshotRequested{ false };
 
-int main()
-{
-	
-	int numDigitsPie=1000;
-	TaskList taskList;
-	PieTable pieTable;
-	std::unordered_map<int, unsigned int> pieMap;
-	int numThreads = std::thread::hardware_concurrency();
-	std::cout << "Computing pi with " << numThreads << " threads \n";
-	std::cout << numDigitsPie << " Digits\n";
+//Worker threads draining a TaskList.  Each finished task's digits go into
+//its result table; with a time slice, unfinished tasks rejoin the queue.
+//
+//Given a lower bound below the CPU count, the pool hill-climbs the number
+//of active workers: every epoch it compares the completed task work per
+//second with the previous epoch, keeps stepping the same way while that
+//improves and turns around when it does not.  Workers above the active
+//count park between tasks.
+//
+//Each worker publishes what it is doing through its own atomics, so the
+//calling thread can print a snapshot on SIGUSR1 without stopping anyone.
+class WorkerPool {
+public:
+	static const int EPOCH_MS = 1000;
+	static const int WATCH_MS = 100;
+	static const int HISTORY = 60;
+	static const int BITMAP_LIMIT = 1 << 26;
+	static const int BAR_WIDTH = 64;
+	static constexpr double HYSTERESIS = 0.03;
+
+	//One controller decision, kept for the report
+	struct Decision {
+		double seconds;
+		int workers;
+		double rate;
+		int next;
+	};
 
-	//Begin by loading the queue with digits of pie
-	
-	//Load index for pie digits into queue
-	for (int i = 1; i < numDigitsPie;i++) {
-		Task temp{ i };
-		taskList.push(temp);
+	WorkerPool(TaskList &taskList, const std::vector<int> &cpus, int quantumMs, int minWorkers = 0)
+		: taskList(taskList), cpus(cpus), quantumMs(quantumMs),
+		minWorkers(minWorkers > 0 ? std::min(minWorkers, (int)cpus.size()) : (int)cpus.size()),
+		active((int)cpus.size()), running(0), status(cpus.size()) {}
+
+	/* run one worker per CPU until the queue is drained */
+	void run() {
+		start = std::chrono::steady_clock::now();
+		markQueued();
+		std::vector<std::thread> threads;
+		running = (int)cpus.size();
+		for (size_t i = 0; i < cpus.size(); i++)
+			threads.push_back(std::thread(&WorkerPool::work, this, (int)i));
+		watch();
+		for (auto &t : threads)
+			t.join();
+	}
+	bool adaptive() const {
+		return minWorkers < (int)cpus.size();
+	}
+	/* write the controller decisions, one line per epoch */
+	void report(std::ostream &out) const {
+		if (!adaptive())
+			return;
+		out << "Worker count between " << minWorkers << " and " << cpus.size() << ":\n";
+		for (auto &d : decisions)
+			out << "  " << d.seconds << " s  " << d.workers << " workers  " << d.rate << " work/s  -> " << d.next << "\n";
+	}
+	/* write what every worker is doing, queue depth, progress, throughput and memory */
+	void snapshot(std::ostream &out) {
+		std::ostringstream text;
+		text << "Snapshot at " << elapsed(std::chrono::steady_clock::now()) << " s\n";
+
+		long long done = 0;
+		for (auto &w : status)
+			done += w.finished.load();
+		text << "  queue: " << taskList.depth() << " waiting, " << done << " of " << queuedTasks << " tasks done";
+		if (!doneBits.empty()) {
+			int through = lowest - 1;
+			for (int id : queuedIds) {
+				if (!isDone(id))
+					break;
+				through = id;
+			}
+			text << ", complete through position " << through << "\n  [" << progressBar() << "]";
+		}
+		text << "\n  throughput: " << rate(1) << " work/s over 1 s, " << rate(10) << " over 10 s, "
+			<< rate(60) << " over 60 s\n";
+
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		for (size_t i = 0; i < status.size(); i++) {
+			WorkerStatus &w = status[i];
+			text << "  worker " << i << " (cpu " << cpus[i] << "): ";
+			int task = w.task.load(std::memory_order_acquire);
+			if (w.parked.load())
+				text << "parked";
+			else if (task == 0)
+				text << "idle";
+			else
+				text << "position " << task << " x" << w.count.load() << " for "
+					<< std::chrono::duration<double>(now - std::chrono::nanoseconds(w.since.load())).count() << " s";
+			text << ", " << w.finished.load() << " done\n";
+		}
+		text << "  memory: " << (MemoryGovernor::instance().inUse() >> 20) << " MB reserved, "
+			<< (residentBytes() >> 20) << " MB resident\n";
+		out << text.str();
+		out.flush();
 	}
+private:
+	//What one worker is doing, written only by that worker
+	struct WorkerStatus {
+		alignas(64) std::atomic<int> task{ 0 };
+		std::atomic<int> count{ 0 };
+		std::atomic<long long> since{ 0 };
+		std::atomic<long long> finished{ 0 };
+		std::atomic<double> work{ 0 };
+		std::atomic<bool> parked{ false };
+	};
 
-	auto threadFunction =
-		[&taskList, &pieTable, numDigitsPie,&pieMap](uint16_t which)
-	{
-		while (!taskList.isEmpty()){
-			std::cout.flush();
-			std::cout << ".";
+	void work(int which) {
+		WorkerStatus &me = status[which];
+		pinThread(cpus[which]);
+		profileThread("queue");
+		while (true){
+			if (which >= active && !park(which))
+				break;
 			taskList.lock();
+			if (taskList.isEmpty()) {
+				taskList.unlock();
+				break;
+			}
 			Task taskTemp = taskList.getTask();
 			taskList.pop();
 			taskList.unlock();
+			if (!taskTemp.started()) {
+				std::cout.flush();
+				std::cout << ".";
+				if (taskTemp.job != nullptr)
+					taskTemp.job->taskStarted();
+			}
+			me.count.store(taskTemp.count);
+			me.since.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+			me.task.store(taskTemp.id, std::memory_order_release);
 			int pieIndex = taskTemp.id;
-			int pieNumber = taskTemp.computePi();
-			pieTable.lock();
-			pieTable.insertValue(pieIndex, pieNumber);
-			pieTable.unlock();
+			std::string pieNumber;
+			//Whole tasks can be shared with other processes; a sliced one
+			//could leave its claim waiting behind blocked workers
+			unsigned long long block = 0;
+			SharedBlockTable::Acquire share = SharedBlockTable::PRIVATE;
+			if (sharedBlocks && quantumMs == 0)
+				block = SharedBlockTable::key(taskTemp.id, taskTemp.count, taskTemp.series, taskTemp.hex);
+			if (block != 0)
+				share = sharedBlocks->acquire(block, pieNumber);
+			if (quantumMs == 0) {
+				if (share != SharedBlockTable::PUBLISHED)
+					pieNumber = taskTemp.computePi();
+			}
+			//Time sliced: unfinished tasks go to the back of the queue
+			else if (!taskTemp.computeSlice(std::chrono::milliseconds(quantumMs), pieNumber)) {
+				me.task.store(0);
+				taskList.lock();
+				taskList.push(taskTemp);
+				taskList.unlock();
+				continue;
+			}
+			if (share == SharedBlockTable::COMPUTE)
+				sharedBlocks->publish(block, pieNumber);
+			taskTemp.results->lock();
+			taskTemp.results->insertValue(pieIndex, pieNumber);
+			taskTemp.results->unlock();
+			if (taskTemp.job != nullptr)
+				taskTemp.job->taskFinished();
+			markDone(taskTemp.id);
+			me.work.store(me.work.load() + taskTemp.work());
+			me.finished.store(me.finished.load() + 1);
+			me.task.store(0);
+		}
+		//A worker leaving means the queue drained, so release the parked ones
+		std::lock_guard<std::mutex> guard(poolMutex);
+		running--;
+		drained = true;
+		changed.notify_all();
+	}
+	/* wait while this worker is above the active count, return false once the queue drained */
+	bool park(int which) {
+		status[which].parked.store(true);
+		std::unique_lock<std::mutex> guard(poolMutex);
+		changed.wait(guard, [&]() { return which < active || drained; });
+		status[which].parked.store(false);
+		return which < active;
+	}
+	/* watch the workers from the calling thread until every one exits:
+	   answer snapshot requests, keep a second-by-second throughput history
+	   and, when adaptive, hill-climb the active count once per epoch.  An
+	   epoch lasts until at least one task has finished. */
+	void watch() {
+		auto last = start, sampled = start;
+		double lastWork = 0, lastRate = 0;
+		int direction = -1;
+		history.push_back(0);
+		std::unique_lock<std::mutex> guard(poolMutex);
+		while (!changed.wait_for(guard, std::chrono::milliseconds(WATCH_MS), [&]() { return running == 0; })) {
+			auto now = std::chrono::steady_clock::now();
+			double workDone = totalWork();
+			if (now - sampled >= std::chrono::seconds(1)) {
+				sampled = now;
+				history.push_back(workDone);
+				if (history.size() > HISTORY + 1)
+					history.erase(history.begin());
+			}
+			if (snapshotRequested.exchange(false)) {
+				guard.unlock();
+				snapshot(std::cerr);
+				guard.lock();
+			}
+			if (!adaptive() || now - last < std::chrono::milliseconds(EPOCH_MS) || workDone == lastWork)
+				continue;
+			double rate = (workDone - lastWork) / std::chrono::duration<double>(now - last).count();
+			if (rate <= lastRate * (1 + HYSTERESIS))
+				direction = -direction;
+			int next = active + direction;
+			if (next < minWorkers || next > (int)cpus.size()) {
+				direction = -direction;
+				next = active + direction;
+			}
+			decisions.push_back(Decision{ elapsed(now), active, rate, next });
+			active = next;
+			changed.notify_all();
+			last = now;
+			lastWork = workDone;
+			lastRate = rate;
+		}
+	}
+
+	double totalWork() const {
+		double sum = 0;
+		for (auto &w : status)
+			sum += w.work.load();
+		return sum;
+	}
+	/* return the work per second over the last seconds of history */
+	double rate(int seconds) const {
+		if (history.size() < 2)
+			return 0;
+		size_t back = std::min((size_t)seconds, history.size() - 1);
+		return (history.back() - history[history.size() - 1 - back]) / back;
+	}
+	double elapsed(std::chrono::steady_clock::time_point t) const {
+		return std::chrono::duration<double>(t - start).count();
+	}
+
+	/* size the completion bitmap over the queued positions */
+	void markQueued() {
+		queuedIds = taskList.ids();
+		queuedTasks = queuedIds.size();
+		if (queuedIds.empty())
+			return;
+		std::sort(queuedIds.begin(), queuedIds.end());
+		lowest = queuedIds.front();
+		long long span = (long long)queuedIds.back() - lowest + 1;
+		if (span <= BITMAP_LIMIT)
+			doneBits = std::vector<std::atomic<unsigned long long>>((size_t)(span + 63) / 64);
+	}
+	void markDone(int id) {
+		if (!doneBits.empty())
+			doneBits[(id - lowest) / 64].fetch_or(1ull << ((id - lowest) % 64));
+	}
+	bool isDone(int id) const {
+		return (doneBits[(id - lowest) / 64].load() >> ((id - lowest) % 64)) & 1;
+	}
+	/* return one character per slice of the positions: '#' all done, '+' some, '.' none */
+	std::string progressBar() const {
+		std::string bar(BAR_WIDTH, ' ');
+		long long span = (long long)queuedIds.back() - lowest + 1;
+		std::vector<int> queued(BAR_WIDTH), done(BAR_WIDTH);
+		for (int id : queuedIds) {
+			int slot = (int)((id - lowest) * BAR_WIDTH / span);
+			queued[slot]++;
+			done[slot] += isDone(id);
+		}
+		for (int i = 0; i < BAR_WIDTH; i++)
+			if (queued[i] > 0)
+				bar[i] = done[i] == queued[i] ? '#' : done[i] > 0 ? '+' : '.';
+		return bar;
+	}
+	static size_t residentBytes() {
+#ifdef __linux__
+		std::ifstream statm("/proc/self/statm");
+		size_t pages, resident;
+		if (statm >> pages >> resident)
+			return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+		return 0;
+	}
+
+	TaskList &taskList;
+	std::vector<int> cpus;
+	int quantumMs;
+	int minWorkers;
+	std::atomic<int> active;
+	std::mutex poolMutex;
+	std::condition_variable changed;
+	int running;
+	bool drained = false;
+	std::vector<WorkerStatus> status;
+	std::chrono::steady_clock::time_point start;
+	std::vector<double> history;
+	std::vector<Decision> decisions;
+	std::vector<int> queuedIds;
+	size_t queuedTasks = 0;
+	int lowest = 0;
+	std::vector<std::atomic<unsigned long long>> doneBits;
+};
+
+//Bound by reference in chrono, so defined for builds before C++17
+const int WorkerPool::EPOCH_MS;
+const int WorkerPool::WATCH_MS;
+
+//Single-producer single-consumer ring.  Head and tail sit on their own
+//cache lines, so producer and consumer only touch the same line when the
+//ring runs empty or full.  A full line of padding after each keeps them
+//apart even where new ignores over-alignment (before C++17).
+template<typename T, size_t CAPACITY>
+class SpscRing {
+public:
+	/* append item, yielding while the ring is full */
+	void push(T item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		while (t - head.load(std::memory_order_acquire) == CAPACITY)
+			std::this_thread::yield();
+		slots[t % CAPACITY] = std::move(item);
+		tail.store(t + 1, std::memory_order_release);
+	}
+	/* take the oldest item, return false if the ring is empty */
+	bool pop(T &item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(slots[h % CAPACITY]);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+private:
+	static const size_t LINE = 64;
+
+	std::atomic<size_t> head{ 0 };
+	char headPad[LINE];
+	std::atomic<size_t> tail{ 0 };
+	char tailPad[LINE];
+	T slots[CAPACITY];
+};
+
+const size_t SHARD_RING = 64;
+
+/* run shard(s, ring) on one pinned thread per CPU and hand every message
+   it pushes to deliver on the calling thread, the rings' only consumer */
+template<typename T, typename Shard, typename Deliver>
+void runShards(const std::vector<int> &cpus, size_t messages, Shard shard, Deliver deliver)
+{
+	std::vector<std::unique_ptr<SpscRing<T, SHARD_RING>>> rings;
+	std::vector<std::thread> threads;
+	for (size_t s = 0; s < cpus.size(); s++) {
+		rings.emplace_back(new SpscRing<T, SHARD_RING>());
+		threads.push_back(std::thread([&, s]()
+		{
+			pinThread(cpus[s]);
+			profileThread("shard");
+			shard((int)s, *rings[s]);
+		}));
+	}
+	T message;
+	for (size_t received = 0; received < messages; ) {
+		bool idle = true;
+		for (auto &ring : rings)
+			while (ring->pop(message)) {
+				deliver(message);
+				received++;
+				idle = false;
+			}
+		if (idle)
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	for (auto &t : threads)
+		t.join();
+}
+
+/* return the digits of each window, shard s owning windows s, s + shards, ...
+   so every core gets a similar mix of shallow and deep windows */
+std::vector<std::string> computeWindowsSharded(const std::vector<std::pair<int, int>> &windows,
+	const std::vector<int> &cpus, int series = 0)
+{
+	typedef std::pair<size_t, std::string> Digits;
+	size_t shards = cpus.size();
+	std::vector<std::string> digits(windows.size());
+	runShards<Digits>(cpus, windows.size(),
+		[&](int s, SpscRing<Digits, SHARD_RING> &ring)
+		{
+			for (size_t i = s; i < windows.size(); i += shards)
+				ring.push(Digits(i, Task(windows[i].first, windows[i].second, nullptr, series).computePi()));
+		},
+		[&](Digits &message) { digits[message.first] = std::move(message.second); });
+	return digits;
+}
+
+/* return the m digits at each position, shard s owning every shards-th
+   prime and its own accumulators, merged as they come off the rings */
+std::vector<std::string> computePiDigitsSharded(const std::vector<int> &positions, int m,
+	const std::vector<int> &cpus, int series = 0)
+{
+	typedef std::pair<size_t, DecimalFraction> Partial;
+	const HypergeometricSeries &c = SERIES[series];
+	int maxPosition = *std::max_element(positions.begin(), positions.end());
+	int N = c.terms(maxPosition + m);
+	int expBits = 1;
+	while (expBits < 31 && (maxPosition >> expBits) != 0)
+		expBits++;
+	int combWidth = positions.size() < 8 ? 0 : chooseCombWidth(1, positions.size(), expBits, (size_t)1 << 16);
+
+	//Every shard owns a row of accumulators and the merged sums take one
+	//more.  As in streaming, use fewer shards rather than more rows than the
+	//budget allows, and batch the positions when not even two rows fit.
+	size_t row = positions.size() * DecimalFraction::footprint(m);
+	size_t batch = MemoryGovernor::instance().available() / (2 * DecimalFraction::footprint(m));
+	if (batch < positions.size() && positions.size() > 1) {
+		batch = std::max<size_t>(1, batch);
+		std::vector<std::string> digits;
+		for (size_t i = 0; i < positions.size(); i += batch) {
+			std::vector<int> part(positions.begin() + i, positions.begin() + std::min(positions.size(), i + batch));
+			std::vector<std::string> partDigits = computePiDigitsSharded(part, m, cpus, series);
+			digits.insert(digits.end(), partDigits.begin(), partDigits.end());
+		}
+		return digits;
+	}
+	size_t rows = MemoryGovernor::instance().available() / row;
+	size_t shards = rows > 2 ? std::min(cpus.size(), rows - 1) : 1;
+	std::vector<int> shardCpus(cpus.begin(), cpus.begin() + shards);
+	MemoryReservation reservation;
+	reservation.reserve((shards + 1) * row);
+
+	std::vector<DecimalFraction> sums(positions.size(), DecimalFraction(m));
+	runShards<Partial>(shardCpus, shards * positions.size(),
+		[&](int s, SpscRing<Partial, SHARD_RING> &ring)
+		{
+			std::vector<DecimalFraction> mine(positions.size(), DecimalFraction(m));
+			size_t index = 0;
+			for (int a = c.firstPrime; a <= c.primeLimit(N); a = next_prime(a), index++)
+				if (index % shards == (size_t)s)
+					addPrimeToPositions(series, a, N, positions, combWidth, expBits, mine);
+			for (size_t i = 0; i < positions.size(); i++)
+				ring.push(Partial(i, std::move(mine[i])));
+		},
+		[&](Partial &message) { sums[message.first].add(message.second); });
+
+	std::vector<std::string> digits;
+	for (auto &sum : sums)
+		digits.push_back(sum.digits(m));
+	return digits;
+}
+
+/* parse one job file line, return nullptr and set error if it is malformed */
+std::unique_ptr<Job> parseJob(const std::string &line, int lineNo, std::string &error)
+{
+	std::istringstream in(line);
+	std::unique_ptr<Job> job(new Job());
+	std::string kind, option;
+	int first = 0, count = 0, width = 0;
+	std::vector<int> positions;
+	job->name = "job" + std::to_string(lineNo);
+
+	in >> kind;
+	if (kind == "range") {
+		if (!(in >> first >> count) || first < 1 || count < 1) {
+			error = "range needs a first digit and a count";
+			return nullptr;
+		}
+	}
+	else if (kind == "sparse") {
+		std::string list, item;
+		in >> list;
+		std::stringstream items(list);
+		while (std::getline(items, item, ','))
+			positions.push_back(std::atoi(item.c_str()));
+		if (positions.empty() || *std::min_element(positions.begin(), positions.end()) < 1) {
+			error = "sparse needs a list of positions";
+			return nullptr;
+		}
+		job->sparse = true;
+	}
+	else {
+		error = "unknown job kind '" + kind + "'";
+		return nullptr;
+	}
+
+	while (in >> option) {
+		size_t eq = option.find('=');
+		std::string key = option.substr(0, eq), value = eq == std::string::npos ? "" : option.substr(eq + 1);
+		if (key == "name")
+			job->name = value;
+		else if (key == "width")
+			width = std::atoi(value.c_str());
+		else if (key == "base" && (value == "dec" || value == "hex"))
+			job->hex = value == "hex";
+		else if (key == "engine" && (value == "table" || value == "window" || value == "stream"))
+			job->engine = value;
+		else if (key == "constant" && findSeries(value) >= 0)
+			job->series = findSeries(value);
+		else if (key == "out" && !value.empty())
+			job->out = value;
+		else {
+			error = "bad option '" + option + "'";
+			return nullptr;
+		}
+	}
+	if (job->hex && job->series != 0) {
+		error = "hex digits are only available for pi";
+		return nullptr;
+	}
+
+	if (width < 1)
+		width = 1;
+	long long end = (long long)first + count;
+	for (int p : positions)
+		end = std::max(end, (long long)p + width);
+	if (end > INT_MAX) {
+		error = "windows end past position " + std::to_string(INT_MAX);
+		return nullptr;
+	}
+	for (int p : positions)
+		job->windows.push_back({ p, width });
+	for (int i = first; i < first + count; i += width)
+		job->windows.push_back({ i, std::min(width, first + count - i) });
+	return job;
+}
+
+/* run every job in the file, decimal and hex windows on two concurrent pools, sharing residue tables per constant */
+int runJobs(const std::string &path, const std::vector<int> &cpus, const std::vector<int> &hexCpus, int quantumMs,
+	int minWorkers)
+{
+	int numThreads = (int)cpus.size();
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "Cannot read " << path << "\n";
+		return 1;
+	}
+	std::vector<std::unique_ptr<Job>> jobs;
+	std::string line, error;
+	for (int lineNo = 1; std::getline(in, line); lineNo++) {
+		if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t")] == '#')
+			continue;
+		std::unique_ptr<Job> job = parseJob(line, lineNo, error);
+		if (!job) {
+			std::cerr << path << ":" << lineNo << ": " << error << "\n";
+			return 1;
+		}
+		const HypergeometricSeries &c = SERIES[job->series];
+		if (!job->hex && !c.fits(c.terms(job->end()))) {
+			std::cerr << path << ":" << lineNo << ": too deep for " << c.name << "\n";
+			return 1;
+		}
+		jobs.push_back(std::move(job));
+	}
+	std::cout << jobs.size() << " Jobs\n";
+
+	//Plan: decimal table jobs of the same constant share one residue table
+	//built for the deepest window among them.  A table the memory budget
+	//cannot hold is skipped and its jobs evaluate each window on its own.
+	std::vector<std::unique_ptr<ResidueTable>> tables(NUM_SERIES);
+	for (int s = 0; s < NUM_SERIES; s++) {
+		int end = 0;
+		size_t windows = 0;
+		for (auto &job : jobs)
+			if (!job->hex && job->engine == "table" && job->series == s) {
+				end = std::max(end, job->end());
+				windows += job->windows.size();
+			}
+		if (windows > 0 && ResidueTable::footprint(end, 0, s) > MemoryGovernor::instance().available())
+			std::cout << "Residue table for " << SERIES[s].name << " over memory budget, evaluating windows directly\n";
+		else if (windows > 0) {
+			double seconds = timeIt([&]() { tables[s].reset(new ResidueTable(end, 0, windows, numThreads, s)); });
+			std::cout << "Residue table for " << SERIES[s].name << " up to digit " << end - 1 << ": "
+				<< tables[s]->primes.size() << " primes, " << seconds << " s\n";
+		}
+	}
+
+	//Decimal and hex tasks get separate pools, each placed with its own
+	//engine's SMT policy from the tuning profile.  The pools run side by
+	//side so neither waits out the other's tail; where their CPU sets
+	//overlap the scheduler shares those CPUs between them.
+	TaskList taskList, hexTaskList;
+	for (auto &job : jobs) {
+		if (job->engine == "stream" && !job->hex)
+			continue;
+		const ResidueTable *table = job->engine == "table" && !job->hex ? tables[job->series].get() : nullptr;
+		for (auto &w : job->windows)
+			(job->hex ? hexTaskList : taskList).push(Task(w.first, w.second, &job->results, job->series, table,
+				job.get(), job->hex));
+	}
+	WorkerPool pool(taskList, cpus, quantumMs, minWorkers);
+	WorkerPool hexPool(hexTaskList, hexCpus, quantumMs, minWorkers);
+	std::thread hexThread([&hexPool]() { hexPool.run(); });
+	pool.run();
+	//Only the decimal pool reads the tables; free them before the streaming jobs reserve
+	tables.clear();
+	hexThread.join();
+	std::cout << "\n";
+	pool.report(std::cout);
+	hexPool.report(std::cout);
+	if (sharedBlocks)
+		sharedBlocks->report(std::cout);
+
+	//Streaming jobs run their own prime-major pass after the pool
+	for (auto &job : jobs) {
+		if (job->engine != "stream" || job->hex)
+			continue;
+		std::vector<int> positions;
+		for (auto &w : job->windows)
+			positions.push_back(w.first);
+		job->taskStarted();
+		std::vector<std::string> digits = computePiDigitsStreaming(positions, job->windows[0].second, numThreads, job->series);
+		for (size_t i = 0; i < positions.size(); i++)
+			job->results.insertValue(positions[i], digits[i].substr(0, job->windows[i].second));
+		job->taskFinished();
+	}
+
+	int status = 0;
+	for (auto &job : jobs) {
+		std::ostringstream text;
+		for (auto &w : job->windows) {
+			if (job->sparse)
+				text << w.first << " " << job->results.get(w.first) << "\n";
+			else
+				text << job->results.get(w.first);
+		}
+		if (!job->sparse)
+			text << "\n";
+		if (job->out == "-")
+			std::cout << text.str();
+		else if (!(std::ofstream(job->out) << text.str())) {
+			std::cerr << "Cannot write " << job->out << "\n";
+			status = 1;
+		}
+		std::cout << job->name << ": " << job->windows.size() << " windows, " << job->seconds() << " s\n";
+	}
+	return status;
+}
+
+
+
+//Answers digit requests read one per line as "client first count" with
+//"client first digits".  Digits are cached in aligned blocks.  Each client's
+//last request and stride predict the next few it will make, and low
+//priority threads compute those blocks ahead of time.  A prefetcher only
+//starts a block while no foreground miss is being computed.  Finished
+//blocks past MAX_BLOCKS are evicted least recently used first.
+class DigitService {
+public:
+	static const int BLOCK = 50;
+	static const int PREFETCH_DEPTH = 4;
+	static const int MAX_BLOCKS = 1 << 16;
+	static const int MAX_QUEUED = 1 << 10;
+	static const int MAX_COUNT = 10000;
+
+	DigitService(int series, int numPrefetchers) : series(series) {
+		for (int i = 0; i < numPrefetchers; i++)
+			prefetchers.push_back(std::thread(&DigitService::prefetch, this));
+	}
+	~DigitService() {
+		serviceMutex.lock();
+		stopping = true;
+		serviceMutex.unlock();
+		wake.notify_all();
+		for (auto &t : prefetchers)
+			t.join();
+	}
+
+	/* answer requests until the input ends */
+	void serve(std::istream &in, std::ostream &out) {
+		std::string line, client;
+		while (std::getline(in, line)) {
+			if (line == "status") {
+				report(out);
+				out.flush();
+				continue;
+			}
+			std::istringstream request(line);
+			int first, count;
+			if (!(request >> client >> first >> count) || count < 1 || count > MAX_COUNT || !reachable(first, count)) {
+				out << "error " << line << std::endl;
+				continue;
+			}
+			predict(client, first, count);
+			std::string digits;
+			for (int b = (first - 1) / BLOCK; b <= (first + count - 2) / BLOCK; b++)
+				digits += block(b);
+			out << client << " " << first << " " << digits.substr((first - 1) % BLOCK, count) << std::endl;
+			requests++;
 		}
+	}
+	void report(std::ostream &out) {
+		std::lock_guard<std::mutex> guard(serviceMutex);
+		size_t lookups = hits + waits + misses;
+		out << "Served " << requests << " requests: " << hits << " block hits, " << waits << " waited on prefetch, "
+			<< misses << " misses (" << (lookups ? 100.0 * (hits + waits) / lookups : 0) << "% from cache), "
+			<< prefetched << " blocks prefetched, " << recentlyUsed.size() << " cached, " << evicted << " evicted, "
+			<< queued.size() << " queued\n";
+	}
+private:
+	enum State { EMPTY, QUEUED, BUSY, READY };
+
+	struct Block {
+		State state = EMPTY;
+		std::string digits;
+		int waiters = 0;
+		std::list<int>::iterator used;
 	};
+	//Last request of a client and the step between its last two
+	struct Client {
+		int first = 0;
+		int count = 0;
+		int stride = 0;
+	};
+
+	/* return true when every block under digits first..first+count-1 is within the series' depth */
+	bool reachable(long long first, int count) const {
+		const HypergeometricSeries &c = SERIES[series];
+		return first >= 1 && first + count + BLOCK < INT_MAX / 4 && c.fits(c.terms((int)first + count + BLOCK));
+	}
+	/* queue the blocks of the next requests when the client pages or strides */
+	void predict(const std::string &name, int first, int count) {
+		std::lock_guard<std::mutex> guard(serviceMutex);
+		Client &c = clients[name];
+		int delta = first - c.first;
+		bool pattern = c.count > 0 && delta != 0 && (delta == c.stride || delta == c.count);
+		c.first = first;
+		c.count = count;
+		c.stride = delta;
+		if (!pattern)
+			return;
+		for (int k = 1; k <= PREFETCH_DEPTH; k++) {
+			long long next = first + (long long)k * delta;
+			if (!reachable(next, count))
+				break;
+			for (int b = (int)(next - 1) / BLOCK; b <= (int)(next + count - 2) / BLOCK; b++) {
+				if (queued.size() >= MAX_QUEUED)
+					break;
+				Block &entry = cache[b];
+				if (entry.state == EMPTY) {
+					entry.state = QUEUED;
+					queued.push(b);
+				}
+			}
+		}
+		wake.notify_all();
+	}
+	/* return the digits of block b, computing them here on a miss */
+	std::string block(int b) {
+		std::unique_lock<std::mutex> guard(serviceMutex);
+		Block &entry = cache[b];
+		if (entry.state == READY) {
+			hits++;
+			recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, entry.used);
+			return entry.digits;
+		}
+		if (entry.state == BUSY) {
+			//A waited-for block is kept out of eviction until it is read
+			waits++;
+			entry.waiters++;
+			computed.wait(guard, [&]() { return entry.state == READY; });
+			entry.waiters--;
+			return entry.digits;
+		}
+		misses++;
+		entry.state = BUSY;
+		foreground++;
+		guard.unlock();
+		std::string digits = computePiDigits(b * BLOCK + 1, BLOCK, series);
+		guard.lock();
+		finish(b, entry, digits);
+		foreground--;
+		computed.notify_all();
+		wake.notify_all();
+		return digits;
+	}
+	/* store the digits of block b, then evict the least recently used
+	   finished blocks past MAX_BLOCKS.  Called with the lock held. */
+	void finish(int b, Block &entry, const std::string &digits) {
+		entry.digits = digits;
+		entry.state = READY;
+		recentlyUsed.push_front(b);
+		entry.used = recentlyUsed.begin();
+		for (size_t scanned = 0; recentlyUsed.size() > MAX_BLOCKS && scanned < recentlyUsed.size(); scanned++) {
+			int oldest = recentlyUsed.back();
+			recentlyUsed.pop_back();
+			Block &victim = cache[oldest];
+			if (victim.waiters > 0) {
+				recentlyUsed.push_front(oldest);
+				victim.used = recentlyUsed.begin();
+			}
+			else {
+				cache.erase(oldest);
+				evicted++;
+			}
+		}
+	}
+	void prefetch() {
+		profileThread("prefetch");
+#ifdef __linux__
+		setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+		std::unique_lock<std::mutex> guard(serviceMutex);
+		while (true) {
+			wake.wait(guard, [&]() { return stopping || (!queued.empty() && foreground == 0); });
+			if (stopping)
+				break;
+			int b = queued.front();
+			queued.pop();
+			Block &entry = cache[b];
+			if (entry.state != QUEUED)
+				continue;
+			entry.state = BUSY;
+			guard.unlock();
+			std::string digits = computePiDigits(b * BLOCK + 1, BLOCK, series);
+			guard.lock();
+			finish(b, entry, digits);
+			prefetched++;
+			computed.notify_all();
+		}
+	}
+
+	int series;
+	std::mutex serviceMutex;
+	std::condition_variable wake, computed;
+	std::unordered_map<int, Block> cache;
+	std::list<int> recentlyUsed;
+	std::unordered_map<std::string, Client> clients;
+	std::queue<int> queued;
+	std::vector<std::thread> prefetchers;
+	bool stopping = false;
+	int foreground = 0;
+	size_t requests = 0, hits = 0, waits = 0, misses = 0, prefetched = 0, evicted = 0;
+};
+
+int main(int argc, char *argv[])
+{
 	
-	//Test for queue being empty
-	
-	//Dynamically create thread array
-	std::thread *threads;
-	threads = new std::thread[numThreads];
+	int numDigitsPie=1000;
+	int firstDigit = 1;
+	int windowWidth = 0;
+	int quantumMs = 0;
+	std::string engine = "table";
+	int series = 0;
+	std::vector<int> positions;
+	std::string jobFile;
+	int memoryMb = 0;
+	int minWorkers = 0, maxWorkers = 0;
+	bool profile = false;
+	bool share = false;
+	bool serve = false;
+	bool usage = false;
+	for (int i = 1; i < argc; i++) {
+		std::string opt = argv[i];
+		if (opt == "--tune") {
+			runTuning();
+			return 0;
+		}
+		else if (opt == "--profile") {
+			profile = true;
+			continue;
+		}
+		else if (opt == "--share") {
+			share = true;
+			continue;
+		}
+		else if (opt == "--serve") {
+			serve = true;
+			continue;
+		}
+		else if (i + 1 == argc)
+			usage = true;
+		else if (opt == "-n")
+			numDigitsPie = std::atoi(argv[i + 1]);
+		else if (opt == "-s")
+			firstDigit = std::atoi(argv[i + 1]);
+		else if (opt == "-w")
+			windowWidth = std::atoi(argv[i + 1]);
+		else if (opt == "-q")
+			quantumMs = std::atoi(argv[i + 1]);
+		else if (opt == "-m")
+			memoryMb = std::atoi(argv[i + 1]);
+		else if (opt == "-a") {
+			char *rest;
+			minWorkers = (int)std::strtol(argv[i + 1], &rest, 10);
+			maxWorkers = *rest == ',' ? std::atoi(rest + 1) : INT_MAX;
+			if (minWorkers < 1 || maxWorkers < minWorkers)
+				usage = true;
+		}
+		else if (opt == "-e")
+			engine = argv[i + 1];
+		else if (opt == "-j")
+			jobFile = argv[i + 1];
+		else if (opt == "-c")
+			series = findSeries(argv[i + 1]);
+		else if (opt == "-p") {
+			std::stringstream list(argv[i + 1]);
+			std::string item;
+			while (std::getline(list, item, ','))
+				positions.push_back(std::atoi(item.c_str()));
+		}
+		else
+			usage = true;
+		i++;
+	}
+	if (usage || numDigitsPie < 1 || firstDigit < 1 || (long long)firstDigit + numDigitsPie > INT_MAX || windowWidth < 0 || quantumMs < 0 || memoryMb < 0 ||
+		(engine != "table" && engine != "stream" && engine != "shard") || series < 0 ||
+		std::any_of(positions.begin(), positions.end(), [](int p) { return p < 1; })) {
+		std::cerr << "usage: " << argv[0] << " [-n digits] [-s first] [-w width] [-p pos,pos,...] [-e table|stream|shard] [-c constant] [-q ms] [-m MB] [-a min[,max]] [--profile] [--share] | -j jobfile | --serve | --tune\n";
+		return 1;
+	}
+	if (memoryMb > 0)
+		MemoryGovernor::instance().setBudget((size_t)memoryMb << 20);
+#ifdef __linux__
+	signal(SIGUSR1, [](int) { snapshotRequested.store(true); });
+#endif
+	if (share && !(sharedBlocks = SharedBlockTable::open(SHARED_BLOCKS)))
+		std::cerr << "Cannot open the shared block table, computing every block here\n";
+	//-n counts the digits printed after firstDigit - 1; lastDigit is one past them
+	int lastDigit = firstDigit + numDigitsPie;
+	TaskList taskList;
+	PieTable pieTable;
+
+	//One worker per physical core, plus SMT siblings when the profile
+	//measured them to help the kernel doing the work
+	tuning.load(TUNING_FILE);
+	CpuTopology topology = CpuTopology::read();
+	std::vector<int> cpus = topology.placement(tuning.smtDecimal);
+	std::vector<int> hexCpus = topology.placement(tuning.smtHex);
+
+	//With adaptive workers every logical CPU is a candidate, in placement
+	//order, and the pool settles on how many of them to use
+	if (minWorkers > 0) {
+		cpus = topology.placement(true);
+		cpus.resize(std::min(cpus.size(), (size_t)maxWorkers));
+		hexCpus = cpus;
+	}
+	int numThreads = (int)cpus.size();
+
+	if (windowWidth == 0)
+		windowWidth = 1;
+
+	//a^vmax must stay within 2^62 for the deepest digit asked for.  The
+	//service checks each request instead, -n means nothing there.
+	const HypergeometricSeries &constant = SERIES[series];
+	int deepest = positions.empty() ? lastDigit : *std::max_element(positions.begin(), positions.end());
+	if (!serve && !constant.fits(constant.terms((long long)deepest + windowWidth))) {
+		std::cerr << "Position " << deepest << " is too deep for " << constant.name << "\n";
+		return 1;
+	}
+	ProfilerSession profilerSession(profile);
+	//Service mode keeps one core for requests and prefetches on the rest, and
+	//stdout carries nothing but the answers
+	if (serve) {
+		DigitService service(series, std::max(1, numThreads - 1));
+		service.serve(std::cin, std::cout);
+		service.report(std::cerr);
+		return 0;
+	}
+	std::cout << "Computing pi with " << numThreads << " threads \n";
+	if (!jobFile.empty())
+		return runJobs(jobFile, cpus, hexCpus, quantumMs, minWorkers);
+
+	//Streaming keeps only per-position accumulators, no queue or table, so
+	//it also takes over when the table would not fit the memory budget
+	if (!positions.empty() && engine == "table" &&
+		ResidueTable::footprint(deepest, windowWidth, series) > MemoryGovernor::instance().available()) {
+		std::cout << "Residue table over memory budget, streaming instead\n";
+		engine = "stream";
+	}
+	if (!positions.empty() && engine != "table") {
+		std::cout << positions.size() << " Positions, " << windowWidth << " Digits each\n";
+		std::vector<std::string> digits = engine == "shard" ?
+			computePiDigitsSharded(positions, windowWidth, cpus, series) :
+			computePiDigitsStreaming(positions, windowWidth, numThreads, series);
+		for (size_t i = 0; i < positions.size(); i++)
+			std::cout << positions[i] << " " << digits[i] << "\n";
+		return 0;
+	}
+
+	//Sparse positions share one residue table, one task per position
+	std::unique_ptr<ResidueTable> residueTable;
+	if (!positions.empty()) {
+		std::cout << positions.size() << " Positions, " << windowWidth << " Digits each\n";
+		int maxPosition = *std::max_element(positions.begin(), positions.end());
+		residueTable.reset(new ResidueTable(maxPosition, windowWidth, positions.size(), numThreads, series));
+		for (int p : positions) {
+			Task temp{ p, windowWidth, &pieTable, series, residueTable.get() };
+			taskList.push(temp);
+		}
+	}
+	//Sharded ranges bypass the queue: each core owns a fixed set of windows
+	//and only the finished digits are collected into the table
+	else if (engine == "shard") {
+		std::cout << numDigitsPie << " Digits\n";
+		std::vector<std::pair<int, int>> windows;
+		for (int i = firstDigit; i < lastDigit; i += windowWidth)
+			windows.push_back(std::make_pair(i, std::min(windowWidth, lastDigit - i)));
+		std::vector<std::string> digits = computeWindowsSharded(windows, cpus, series);
+		for (size_t i = 0; i < windows.size(); i++)
+			pieTable.insertValue(windows[i].first, digits[i]);
+	}
+	else {
+		std::cout << numDigitsPie << " Digits\n";
+
+		//Begin by loading the queue with digits of pie
+
+		//Load index for pie digits into queue, windowWidth digits per task
+		for (int i = firstDigit; i < lastDigit; i += windowWidth) {
+			Task temp{ i, std::min(windowWidth, lastDigit - i), &pieTable, series };
+			taskList.push(temp);
+		}
+	}
 
 	//Run threads then join
-	for (int i = 0; i < numThreads; i++) {threads[i]= std::thread(threadFunction, i);}
-	for (int i = 0; i < numThreads; i++) {threads[i].join();}
+	WorkerPool pool(taskList, cpus, quantumMs, minWorkers);
+	pool.run();
 
 	//Print results :)
 	std::cout.flush();
-	std::cout << "\n3.";
-	for (int i = 1; i < numDigitsPie; i++) {
-		std::cout << pieTable.get(i);
+	if (pool.adaptive()) {
+		std::cout << "\n";
+		pool.report(std::cout);
+	}
+	if (sharedBlocks) {
+		std::cout << "\n";
+		sharedBlocks->report(std::cout);
+	}
+	if (!positions.empty()) {
+		std::cout << "\n";
+		for (int p : positions)
+			std::cout << p << " " << pieTable.get(p) << "\n";
+		return 0;
+	}
+	std::string decimal;
+	for (int i = firstDigit; i < lastDigit; i += windowWidth) {
+		decimal += pieTable.get(i);
+	}
+	std::cout << "\n" << (firstDigit == 1 ? std::string(constant.integerPart) + "." : "") << decimal << std::endl;
+
+	//A full prefix of pi can be checked against BBP hex digits near its end
+	if (firstDigit == 1 && series == 0) {
+		HexCheck check = verifyWithHex(decimal, (int)hexCpus.size());
+		if (check.count > 0)
+			std::cout << "Hex check of positions " << check.first << "-" << check.first + check.count - 1 << ": "
+				<< (check.pass() ? "pass" : "FAIL") << " (" << check.computed << " vs " << check.expected << ")\n";
 	}
-	std::cout << std::endl;
 
 
 	return 0;